@@ -12,813 +12,5263 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <stdarg.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
+#include <sys/stat.h>
+#include <dirent.h>
 
-#ifdef LOADER
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
-#include <windows.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
-#ifdef DLL
+// The patcher can queue its output with io_uring, the kernel headers are enough
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IO_URING 1
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// The DLL and the harness patch the memory of their own process
+#if defined(DLL) || (defined(HARNESS) && !defined(REMOTE))
+#define IN_PROCESS 1
+#endif
 
-typedef void* Target;
+#ifdef REMOTE
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#endif
 
-static void writex(Target target, off_t offset, const void* data, size_t size) {
-  //MessageBoxA(NULL, "Meep", "Meep X", 0);
-  void* address = (void*)(uintptr_t)offset;
-  DWORD old_protect;
-  VirtualProtect(address, size, PAGE_EXECUTE_READWRITE, &old_protect);
-  memcpy(address, data, size);
-  VirtualProtect(address, size, old_protect, &old_protect);
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// With GCC and clang, code for x86 can use AVX2 when the CPU has it, even if the build doesn't
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && !defined(__AVX2__)
+#include <immintrin.h>
+#define AVX2_DISPATCH 1
+#endif
+
+
+// Patches don't touch the target directly; they are recorded in a plan first
+typedef enum {
+  PATCH_CODE,
+  PATCH_DATA,
+  PATCH_POINTER
+} PatchKind;
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  size_t data_offset;
+  size_t index;
+  PatchKind kind;
+  const char* patch;
+} PatchRecord;
+
+// Bytes which have been written by a patch
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  const char* patch;
+} OwnedRange;
+
+typedef struct {
+  PatchRecord* records;
+  size_t record_count;
+  size_t record_capacity;
+  uint8_t* data;
+  size_t data_size;
+  size_t data_capacity;
+  const char* patch;
+
+  // Index of who owns which bytes, sorted by address and without overlaps
+  OwnedRange* owned;
+  size_t owned_count;
+  size_t owned_capacity;
+
+  // First error while planning; the patches carry on, but the plan is never applied
+  bool failed;
+  char error[256];
+
+  // Only the sizes of the arenas are wanted: nothing is printed and textures are not loaded
+  bool measuring;
+
+  // RC4 state of the network GUID, which is carried from patch to patch
+  uint8_t guid_state[256];
+  bool guid_initialized;
+} Plan;
+
+// Merged bytes of the plan, which are ready to be written to the target
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  const uint8_t* data;
+} WriteBlock;
+
+// Number of system calls which were used to access the target memory
+typedef struct {
+  unsigned int protect_count;
+  unsigned int query_count;
+  unsigned int write_count;
+  unsigned int read_count;
+} BackendStats;
+
+static BackendStats backend_stats;
+
+// Locations in the game which are used by the patches
+typedef enum {
+  SITE_GUID,
+  SITE_UPGRADE_MENU_LEVEL,
+  SITE_UPGRADE_MENU_HEALTH,
+  SITE_GENERATE_UPGRADED_HANDLING,
+  SITE_UPGRADE_HOOK,
+  SITE_IS_MULTIPLAYER,
+  SITE_COLLIDE,
+  SITE_COLLISION_HOOK,
+  SITE_AUDIO_BUFFER_SIZE,
+  SITE_AUDIO_BITS_PER_SAMPLE,
+  SITE_AUDIO_SAMPLERATE,
+  SITE_AUDIO_CHUNK_SIZE_0,
+  SITE_AUDIO_CHUNK_SIZE_1,
+  SITE_AUDIO_CHUNK_SIZE_2,
+  SITE_SPRINTF,
+  SITE_LOAD_SPRITE_FROM_TGA,
+  SITE_LOAD_SPRITE_INTERNAL,
+  SITE_SPRITE_LOADER_HOOK,
+  SITE_SHOW_MESSAGE,
+  SITE_RUN_TRIGGER,
+  SITE_TRIGGER_HOOK,
+  SITE_FONT0_TABLE,
+  SITE_FONT0_HOOK,
+  SITE_FONT0_RETURN,
+  SITE_FONT1_TABLE,
+  SITE_FONT1_HOOK,
+  SITE_FONT1_RETURN,
+  SITE_FONT2_TABLE,
+  SITE_FONT2_HOOK,
+  SITE_FONT2_RETURN,
+  SITE_FONT3_TABLE,
+  SITE_FONT3_HOOK,
+  SITE_FONT3_RETURN,
+  SITE_FONT4_TABLE,
+  SITE_FONT4_HOOK,
+  SITE_FONT4_RETURN,
+  SITE_COUNT
+} Site;
+
+static const char* site_names[SITE_COUNT] = {
+  [SITE_GUID] = "guid",
+  [SITE_UPGRADE_MENU_LEVEL] = "upgrade_menu_level",
+  [SITE_UPGRADE_MENU_HEALTH] = "upgrade_menu_health",
+  [SITE_GENERATE_UPGRADED_HANDLING] = "generate_upgraded_handling",
+  [SITE_UPGRADE_HOOK] = "upgrade_hook",
+  [SITE_IS_MULTIPLAYER] = "is_multiplayer",
+  [SITE_COLLIDE] = "collide",
+  [SITE_COLLISION_HOOK] = "collision_hook",
+  [SITE_AUDIO_BUFFER_SIZE] = "audio_buffer_size",
+  [SITE_AUDIO_BITS_PER_SAMPLE] = "audio_bits_per_sample",
+  [SITE_AUDIO_SAMPLERATE] = "audio_samplerate",
+  [SITE_AUDIO_CHUNK_SIZE_0] = "audio_chunk_size_0",
+  [SITE_AUDIO_CHUNK_SIZE_1] = "audio_chunk_size_1",
+  [SITE_AUDIO_CHUNK_SIZE_2] = "audio_chunk_size_2",
+  [SITE_SPRINTF] = "sprintf",
+  [SITE_LOAD_SPRITE_FROM_TGA] = "load_sprite_from_tga",
+  [SITE_LOAD_SPRITE_INTERNAL] = "load_sprite_internal",
+  [SITE_SPRITE_LOADER_HOOK] = "sprite_loader_hook",
+  [SITE_SHOW_MESSAGE] = "show_message",
+  [SITE_RUN_TRIGGER] = "run_trigger",
+  [SITE_TRIGGER_HOOK] = "trigger_hook",
+  [SITE_FONT0_TABLE] = "font0_table",
+  [SITE_FONT0_HOOK] = "font0_hook",
+  [SITE_FONT0_RETURN] = "font0_return",
+  [SITE_FONT1_TABLE] = "font1_table",
+  [SITE_FONT1_HOOK] = "font1_hook",
+  [SITE_FONT1_RETURN] = "font1_return",
+  [SITE_FONT2_TABLE] = "font2_table",
+  [SITE_FONT2_HOOK] = "font2_hook",
+  [SITE_FONT2_RETURN] = "font2_return",
+  [SITE_FONT3_TABLE] = "font3_table",
+  [SITE_FONT3_HOOK] = "font3_hook",
+  [SITE_FONT3_RETURN] = "font3_return",
+  [SITE_FONT4_TABLE] = "font4_table",
+  [SITE_FONT4_HOOK] = "font4_hook",
+  [SITE_FONT4_RETURN] = "font4_return",
+};
+
+typedef struct {
+  uint32_t address[SITE_COUNT];
+} Addresses;
+
+// Known versions of the game, generated from versions.txt
+typedef struct {
+  const char* name;
+  uint32_t timestamp;
+  uint64_t fingerprints[8];
+  unsigned int fingerprint_count;
+  Addresses addresses;
+} Version;
+
+#include "versions.h"
+
+// The patch region is split into arenas, which become separate sections
+typedef enum {
+  ARENA_CODE,
+  ARENA_RODATA,
+  ARENA_DATA,
+  ARENA_JOURNAL,
+  ARENA_TEXTURES,
+  ARENA_COUNT
+} ArenaType;
+
+typedef struct {
+  const char* name;
+  uint32_t alignment;
+  uint32_t capacity;
+  uint32_t characteristics;
+  uint32_t base;
+  uint32_t size;
+} Arena;
+
+typedef struct {
+  Arena arenas[ARENA_COUNT];
+} Allocator;
+
+// Reserve more space when patching in memory, say... 4MB?
+uint32_t patch_size = 4 * 1024 * 1024;
+
+// Keeps the first error of a plan, the exe is then reported as failed instead of patched
+static void plan_error(Plan* plan, const char* format, ...) {
+  if (plan->failed) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf(plan->error, sizeof(plan->error), format, args);
+  va_end(args);
+  plan->failed = true;
   return;
 }
 
-static void readx(Target target, off_t offset, void* data, size_t size) {
-  memcpy(data, (void*)(uintptr_t)offset, size);
+// Progress output of the patches, which is left out while only measuring
+static void patch_log(const Plan* plan, const char* format, ...) {
+  if (plan->measuring) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
   return;
 }
 
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Wall clock time, unlike clock() this also works across threads
+static double wall_milliseconds(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart * 1000.0 / frequency.QuadPart;
 #else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
 
+// Accesses to the target, counted for the stage which caused them
 typedef struct {
-  PROCESS_INFORMATION process_information;
-} Target;
+  unsigned int read_count;
+  size_t read_size;
+  unsigned int plan_count;
+  size_t plan_size;
+  unsigned int write_count;
+  size_t write_size;
+  unsigned int seek_count;
+} TraceCounters;
 
-static void writex(Target target, off_t offset, const void* data, size_t size) {
-  void* address = (void*)(uintptr_t)offset;
-  DWORD old_protect;
-  VirtualProtectEx(target.process_information.hProcess, address, size, PAGE_EXECUTE_READWRITE, &old_protect);
-  BOOL status = WriteProcessMemory(target.process_information.hProcess, address, data, size, NULL);
-  assert(status != 0);
-  VirtualProtectEx(target.process_information.hProcess, address, size, old_protect, &old_protect);
+typedef struct {
+  const char* name;
+  unsigned int entered;
+  double milliseconds;
+  TraceCounters counters;
+} TraceStage;
+
+// Records where a run spends its time; everything is skipped unless it's enabled
+typedef struct {
+  bool enabled;
+  TraceStage stages[64];
+  unsigned int stage_count;
+  TraceStage* stage;
+  double stage_start;
+  TraceCounters counters;
+  size_t next_offset;
+} Trace;
+
+static Trace trace;
+
+// Ends the current stage and starts the next one; stages with the same name are added up
+static void trace_stage(const char* name) {
+  if (!trace.enabled) {
+    return;
+  }
+  if ((trace.stage != NULL) && (name != NULL) && !strcmp(trace.stage->name, name)) {
+    return;
+  }
+
+  double now = wall_milliseconds();
+  TraceStage* stage = trace.stage;
+  if (stage != NULL) {
+    stage->milliseconds += now - trace.stage_start;
+    stage->counters.read_count += trace.counters.read_count;
+    stage->counters.read_size += trace.counters.read_size;
+    stage->counters.plan_count += trace.counters.plan_count;
+    stage->counters.plan_size += trace.counters.plan_size;
+    stage->counters.write_count += trace.counters.write_count;
+    stage->counters.write_size += trace.counters.write_size;
+    stage->counters.seek_count += trace.counters.seek_count;
+  }
+  memset(&trace.counters, 0x00, sizeof(TraceCounters));
+  trace.stage = NULL;
+  if (name == NULL) {
+    return;
+  }
+
+  for(unsigned int i = 0; i < trace.stage_count; i++) {
+    if (!strcmp(trace.stages[i].name, name)) {
+      trace.stage = &trace.stages[i];
+      break;
+    }
+  }
+  if ((trace.stage == NULL) && (trace.stage_count < (sizeof(trace.stages) / sizeof(trace.stages[0])))) {
+    trace.stage = &trace.stages[trace.stage_count++];
+    memset(trace.stage, 0x00, sizeof(TraceStage));
+    trace.stage->name = name;
+  }
+  if (trace.stage != NULL) {
+    trace.stage->entered++;
+  }
+
+  // Don't count the time it took to find the stage
+  trace.stage_start = wall_milliseconds();
   return;
 }
 
-static void readx(Target target, off_t offset, void* data, size_t size) {
-  ReadProcessMemory(target.process_information.hProcess, (void*)(uintptr_t)offset, data, size, NULL);
+// Counts an access to the file, accesses which don't continue the previous one need a seek
+static void trace_access(bool write, size_t offset, size_t size) {
+  if (!trace.enabled) {
+    return;
+  }
+  if (write) {
+    trace.counters.write_count++;
+    trace.counters.write_size += size;
+  } else {
+    trace.counters.read_count++;
+    trace.counters.read_size += size;
+  }
+  if (offset != trace.next_offset) {
+    trace.counters.seek_count++;
+  }
+  trace.next_offset = offset + size;
   return;
 }
 
-#endif
+static void write_trace_string(FILE* f, const char* string) {
+  fputc('"', f);
+  for(const char* c = string; *c != '\0'; c++) {
+    if ((*c == '"') || (*c == '\\')) {
+      fprintf(f, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(f, "\\u%04X", (unsigned char)*c);
+    } else {
+      fputc(*c, f);
+    }
+  }
+  fputc('"', f);
+  return;
+}
 
-#else
+// One stage per line, so traces of two runs can be compared with diff
+static void write_trace(FILE* f, const char* path, const char* version, const char* error) {
+  trace_stage(NULL);
 
-static off_t mapExe(uint32_t offset) {
-  /*
-    From `objdump -x swep1rcr.exe` for the patched US version:
-
-    0 .text         000aa750  00401000  00401000  00000400  2**2
-                    CONTENTS, ALLOC, LOAD, READONLY, CODE
-    1 .rdata        000054a2  004ac000  004ac000  000aac00  2**2
-                    CONTENTS, ALLOC, LOAD, READONLY, DATA
-    2 .data         00023600  004b2000  004b2000  000b0200  2**2
-                    CONTENTS, ALLOC, LOAD, DATA
-    3 .rsrc         000017b8  00ece000  00ece000  000d3800  2**2
-  */
-
-  assert(offset >= 0x400000);
-
-  if (offset >= 0x00ed0000) {
-    // hack
-    offset -= 0x00ed0000;
-    offset += 0x000d5000;
-  } else if (offset >= 0x00ece000) {
-    // .rsrc
-    offset -= 0x00ece000;
-    offset += 0x000d3800;
-  } else if (offset >= 0x004b2000) {
-   // .data
-    offset -= 0x004b2000;
-    offset += 0x000b0200;
-  } else if (offset >= 0x004ac000) {
-    // .rdata
-    offset -= 0x004ac000;
-    offset += 0x000aac00;
-  } else if (offset >= 0x00401000) {
-    // .text
-    offset -= 0x00401000;
-    offset += 0x00000400;
-  } else {
-    // headers
-    offset -= 0x00400000;
+  double milliseconds = 0.0;
+  for(unsigned int i = 0; i < trace.stage_count; i++) {
+    milliseconds += trace.stages[i].milliseconds;
+  }
+
+  fprintf(f, "{\n  \"exe\": ");
+  write_trace_string(f, (path != NULL) ? path : "");
+  fprintf(f, ",\n  \"version\": ");
+  write_trace_string(f, (version != NULL) ? version : "");
+  fprintf(f, ",\n  \"error\": ");
+  write_trace_string(f, (error != NULL) ? error : "");
+  fprintf(f, ",\n  \"milliseconds\": %.3f,\n  \"stages\": [", milliseconds);
+  for(unsigned int i = 0; i < trace.stage_count; i++) {
+    TraceStage* stage = &trace.stages[i];
+    fprintf(f, "%s\n    { \"name\": ", (i > 0) ? "," : "");
+    write_trace_string(f, stage->name);
+    fprintf(f, ", \"entered\": %u, \"milliseconds\": %.3f, "
+               "\"reads\": %u, \"read_bytes\": %zu, "
+               "\"planned_writes\": %u, \"planned_bytes\": %zu, "
+               "\"writes\": %u, \"write_bytes\": %zu, \"seeks\": %u }",
+            stage->entered, stage->milliseconds,
+            stage->counters.read_count, stage->counters.read_size,
+            stage->counters.plan_count, stage->counters.plan_size,
+            stage->counters.write_count, stage->counters.write_size,
+            stage->counters.seek_count);
   }
-  return offset;
+  fprintf(f, "\n  ]\n}\n");
+  fflush(f);
+  return;
 }
 
+#if defined(HARNESS)
+
+// The harness patches a copy of the exe which is mapped into its own process,
+// the same way the DLL patches the running game.
+// With REMOTE, the copy is mapped into a stopped child process instead, which
+// is patched from the outside like the loader does it.
 typedef struct {
-  FILE* f;
+  uint32_t address;
+  uint32_t size;
+  int protection;
+} Region;
+
+typedef struct {
+  pid_t pid;
+  Region regions[100];
+  unsigned int region_count;
+} Process;
+
+typedef struct {
+  Process* process;
+  const Addresses* addresses;
+  Plan* plan;
+  Allocator* allocator;
 } Target;
 
-static void writex(Target target, off_t offset, const void* data, size_t size) {
-  fseek(target.f, mapExe(offset), SEEK_SET);
-  fwrite(data, size, 1, target.f);
+// Protects the pages of a region and remembers the protection for later writes
+static void add_region(Process* process, uint32_t address, uint32_t size, int protection) {
+  assert(process->region_count < (sizeof(process->regions) / sizeof(process->regions[0])));
+  Region* region = &process->regions[process->region_count++];
+  region->address = address;
+  region->size = size;
+  region->protection = protection;
+#ifdef REMOTE
+  // Protection can't be changed from the outside, so the child stays writeable
+  protection |= PROT_WRITE;
+#endif
+  int status = mprotect((void*)(uintptr_t)address, size, protection);
+  assert(status == 0);
   return;
 }
 
+#ifdef REMOTE
+
 static void readx(Target target, off_t offset, void* data, size_t size) {
-  fseek(target.f, mapExe(offset), SEEK_SET);
-  fread(data, size, 1, target.f);
+  struct iovec local = { data, size };
+  struct iovec remote = { (void*)(uintptr_t)offset, size };
+  ssize_t read_size = process_vm_readv(target.process->pid, &local, 1, &remote, 1, 0);
+  assert(read_size == (ssize_t)size);
+  backend_stats.read_count++;
   return;
 }
 
-#endif
+#else
 
-static uint8_t read8(Target target, off_t offset) {
-  uint8_t value;
-  readx(target, offset, &value, 1);
-  return value;
+typedef int Protection;
+#define PROTECTION_WRITABLE (PROT_READ | PROT_WRITE)
+
+// The harness knows the protection of each region, so this is not a system call
+static Protection query_protection(Target target, uint32_t address, uint32_t* end) {
+  Process* process = target.process;
+  for(unsigned int i = 0; i < process->region_count; i++) {
+    Region* region = &process->regions[i];
+    if ((address >= region->address) && ((address - region->address) < region->size)) {
+      *end = region->address + region->size;
+      return region->protection;
+    }
+  }
+  fprintf(stderr, "Address 0x%08X is not mapped\n", address);
+  assert(false);
+  return PROT_NONE;
 }
 
-static void write8(Target target, off_t offset, uint8_t value) {
-  writex(target, offset, &value, 1);
+static void set_protection(Target target, uint32_t address, uint32_t size, Protection protection) {
+  int status = mprotect((void*)(uintptr_t)address, size, protection);
+  assert(status == 0);
+  backend_stats.protect_count++;
   return;
 }
 
-static uint16_t read16(Target target, off_t offset) {
-  uint16_t value;
-  readx(target, offset, &value, 2);
-  return value;
+static void write_run(Target target, const WriteBlock* blocks, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    memcpy((void*)(uintptr_t)blocks[i].address, blocks[i].data, blocks[i].size);
+  }
+  return;
 }
 
-static void write16(Target target, off_t offset, uint16_t value) {
-  writex(target, offset, &value, 2);
+static void readx(Target target, off_t offset, void* data, size_t size) {
+  memcpy(data, (void*)(uintptr_t)offset, size);
   return;
 }
 
-static uint32_t read32(Target target, off_t offset) {
-  uint32_t value;
-  readx(target, offset, &value, 4);
-  return value;
-}
+#endif
 
-static void write32(Target target, off_t offset, uint32_t value) {
-  writex(target, offset, &value, 4);
-  return;
-}
+#elif defined(LOADER)
 
-static void patch16_add(Target target, off_t offset, uint16_t delta) {
-  write16(target, offset, read16(target, offset) + delta);
-  return;
+#ifdef DLL
+
+typedef struct {
+  const Addresses* addresses;
+  Plan* plan;
+  Allocator* allocator;
+} Target;
+
+typedef DWORD Protection;
+#define PROTECTION_WRITABLE PAGE_EXECUTE_READWRITE
+
+static Protection query_protection(Target target, uint32_t address, uint32_t* end) {
+  MEMORY_BASIC_INFORMATION info;
+  SIZE_T status = VirtualQuery((void*)(uintptr_t)address, &info, sizeof(info));
+  assert(status != 0);
+  backend_stats.query_count++;
+  *end = (uintptr_t)info.BaseAddress + info.RegionSize;
+  return info.Protect;
 }
 
-static void patch32_add(Target target, off_t offset, uint32_t delta) {
-  write32(target, offset, read32(target, offset) + delta);
+static void set_protection(Target target, uint32_t address, uint32_t size, Protection protection) {
+  DWORD old_protect;
+  BOOL status = VirtualProtect((void*)(uintptr_t)address, size, protection, &old_protect);
+  assert(status != 0);
+  backend_stats.protect_count++;
   return;
 }
 
-static uint32_t add_esp(Target target, uint32_t memory_offset, int32_t n) {
-  write8(target, memory_offset, 0x81); memory_offset += 1;
-  write8(target, memory_offset, 0xC4); memory_offset += 1;
-  write32(target, memory_offset, (uint32_t)n); memory_offset += 4;
-  return memory_offset;
+static void write_run(Target target, const WriteBlock* blocks, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    memcpy((void*)(uintptr_t)blocks[i].address, blocks[i].data, blocks[i].size);
+  }
+  return;
 }
 
-static uint32_t test_eax_eax(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write8(target, memory_offset, 0xC0); memory_offset += 1;
-  return memory_offset;
+static void readx(Target target, off_t offset, void* data, size_t size) {
+  memcpy(data, (void*)(uintptr_t)offset, size);
+  return;
 }
 
-static uint32_t test_edx_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write8(target, memory_offset, 0xD2); memory_offset += 1;
-  return memory_offset;
-}
+#else
 
-static uint32_t nop(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x90); memory_offset += 1;
-  return memory_offset;
-}
+typedef struct {
+  PROCESS_INFORMATION process_information;
+  const Addresses* addresses;
+  Plan* plan;
+  Allocator* allocator;
+} Target;
 
-static uint32_t push_eax(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x50); memory_offset += 1;
-  return memory_offset;
-}
+typedef DWORD Protection;
+#define PROTECTION_WRITABLE PAGE_EXECUTE_READWRITE
 
-static uint32_t push_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x52); memory_offset += 1;
-  return memory_offset;
+static Protection query_protection(Target target, uint32_t address, uint32_t* end) {
+  MEMORY_BASIC_INFORMATION info;
+  SIZE_T status = VirtualQueryEx(target.process_information.hProcess, (void*)(uintptr_t)address, &info, sizeof(info));
+  assert(status != 0);
+  backend_stats.query_count++;
+  *end = (uintptr_t)info.BaseAddress + info.RegionSize;
+  return info.Protect;
 }
 
-static uint32_t pop_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x5A); memory_offset += 1;
-  return memory_offset;
+static void set_protection(Target target, uint32_t address, uint32_t size, Protection protection) {
+  DWORD old_protect;
+  BOOL status = VirtualProtectEx(target.process_information.hProcess, (void*)(uintptr_t)address, size, protection, &old_protect);
+  assert(status != 0);
+  backend_stats.protect_count++;
+  return;
 }
 
-static uint32_t push_u32(Target target, uint32_t memory_offset, uint32_t value) {
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, value); memory_offset += 4;
-  return memory_offset;
-}
+// There is no gather write for other processes, so blocks which are close
+// together are written as one range, after reading the bytes in between
+static void write_run(Target target, const WriteBlock* blocks, size_t count) {
+  HANDLE process = target.process_information.hProcess;
+  size_t i = 0;
+  while(i < count) {
+    uint32_t begin = blocks[i].address;
+    uint32_t end = begin + blocks[i].size;
+    size_t j = i + 1;
+    while((j < count) && (blocks[j].address <= (end + 0x1000))) {
+      end = blocks[j].address + blocks[j].size;
+      j++;
+    }
 
-static uint32_t call(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0xE8); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
-}
+    BOOL status;
+    if ((j - i) == 1) {
+      status = WriteProcessMemory(process, (void*)(uintptr_t)begin, blocks[i].data, blocks[i].size, NULL);
+    } else {
+      uint8_t* span = malloc(end - begin);
+      assert(span != NULL);
+      status = ReadProcessMemory(process, (void*)(uintptr_t)begin, span, end - begin, NULL);
+      assert(status != 0);
+      backend_stats.read_count++;
+      for(size_t k = i; k < j; k++) {
+        memcpy(&span[blocks[k].address - begin], blocks[k].data, blocks[k].size);
+      }
+      status = WriteProcessMemory(process, (void*)(uintptr_t)begin, span, end - begin, NULL);
+      free(span);
+    }
+    assert(status != 0);
+    backend_stats.write_count++;
 
-static uint32_t jmp(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0xE9); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
+    i = j;
+  }
+  return;
 }
 
-static uint32_t jnz(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
+static void readx(Target target, off_t offset, void* data, size_t size) {
+  BOOL status = ReadProcessMemory(target.process_information.hProcess, (void*)(uintptr_t)offset, data, size, NULL);
+  assert(status != 0);
+  backend_stats.read_count++;
+  return;
 }
 
-static uint32_t retn(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0xC3); memory_offset += 1;
-  return memory_offset;
-}
+#endif
 
-#if 0
+#else
 
-static void* readExe(Target target, uint32_t offset, size_t size) {
+// The whole exe is kept in memory, so patches don't have to go through stdio
+// Address translation is driven by the section table of the exe
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  uint32_t file_offset;
+} MappedSection;
 
-  // Find correct location in binary
-  offset = offset;
+typedef struct {
+  size_t offset;
+  size_t size;
+} FileRange;
 
-  // Allocate space for the read
-  void* data = malloc(size);
+typedef struct {
+  const char* path;
+  FILE* f;
+  uint8_t* data;
+  size_t size;
+  size_t content_size;
+  MappedSection sections[96];
+  unsigned int section_count;
+  unsigned int last_section;
+
+  // Ranges of the file which were changed, so a copy of the original only needs those
+  FileRange* dirty;
+  size_t dirty_count;
+  size_t dirty_capacity;
+  bool dirty_valid;
+} Image;
 
-  // Read the data from the exe
-  off_t previous_offset = ftell(f);
-  fseek(target, offset, SEEK_SET);
-  fread(data, size, 1, f);
-  fseek(target, previous_offset, SEEK_SET);
+typedef struct {
+  Image* image;
+  const Addresses* addresses;
+  Plan* plan;
+  Allocator* allocator;
+} Target;
 
-  return data;
+static void clear_sections(Image* image) {
+  image->section_count = 0;
+  image->last_section = 0;
+  return;
 }
 
-static void dumpTexture(Target target, size_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
-  // Presumably the format information?
-  assert(unk0 == 3);
-  assert(unk1 == 0);
-
-  FILE* out = fopen(filename, "wb");
-  fprintf(out, "P3\n%d %d\n15\n", width, height);
+// Makes `size` bytes at virtual address `address` accessible at `file_offset`
+static void map_section(Image* image, uint32_t address, uint32_t file_offset, uint32_t size) {
+  assert(image->section_count < (sizeof(image->sections) / sizeof(image->sections[0])));
 
-  // Copy the pixel data
-  uint8_t* texture = readExe(target, offset, width * height * 4 / 8);
-  for(unsigned int i = 0; i < width * height * 2; i++) {
-    uint8_t v = ((texture[i / 2] << ((i % 2) * 4)) & 0xF0) >> 4;
-    fprintf(out, "%d %d %d\n", v, v, v);
+  // Keep the table sorted by address
+  unsigned int i = image->section_count;
+  while((i > 0) && (image->sections[i - 1].address > address)) {
+    image->sections[i] = image->sections[i - 1];
+    i--;
   }
-  free(texture);
+  image->sections[i].address = address;
+  image->sections[i].size = size;
+  image->sections[i].file_offset = file_offset;
+  image->section_count++;
 
-  fclose(out);
+  image->last_section = 0;
   return;
 }
 
-static uint32_t dumpTextureTable(Target target, uint32_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
-  char filename_i[4096]; //FIXME: Size
-
-  // Get size of the table
-  uint32_t* buffer = readExe(target, offset + 0, 4);
-  uint32_t count = *buffer;
-  free(buffer);
+static off_t mapExe(Image* image, uint32_t offset) {
 
-  // Loop over elements and dump each
-  printf("// %s at 0x%X\n", filename, offset);
-  uint32_t* offsets = readExe(target, offset + 4, count * 4);
-  for(unsigned int i = 0; i < count; i++) {
-    sprintf(filename_i, "%s_%d.ppm", filename, i);
-    printf("// - [%d]: 0x%X\n", i, offsets[i]);
-    dumpTexture(target, offsets[i], unk0, unk1, width, height, filename_i);
+  // Most accesses hit the same section as the previous one
+  if (image->last_section < image->section_count) {
+    MappedSection* section = &image->sections[image->last_section];
+    if ((offset >= section->address) && ((offset - section->address) < section->size)) {
+      return section->file_offset + (offset - section->address);
+    }
   }
-  free(offsets);
-  return count;
-}
 
-#endif
+  // Find the last section which starts at or before the address
+  unsigned int low = 0;
+  unsigned int high = image->section_count;
+  while(low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    if (image->sections[middle].address <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low > 0) {
+    MappedSection* section = &image->sections[low - 1];
+    if ((offset - section->address) < section->size) {
+      image->last_section = low - 1;
+      return section->file_offset + (offset - section->address);
+    }
+  }
 
-static uint32_t patchTextureTable(Target target, uint32_t memory_offset, uint32_t offset, uint32_t code_begin_offset, uint32_t code_end_offset, uint32_t width, uint32_t height, const char* filename) {
+  // The caller reports this, so only this exe fails
+  return -1;
+}
 
-#if 1
-  // Attempt to realign the disassembler
-  for(unsigned int i = 0; i < 16; i++) {
-    memory_offset = nop(target, memory_offset);
+static bool load_image(Image* image, const char* path) {
+  clear_sections(image);
+  image->path = path;
+  image->dirty = NULL;
+  image->dirty_count = 0;
+  image->dirty_capacity = 0;
+  image->dirty_valid = true;
+
+  image->f = fopen(path, "rb+");
+  if (image->f == NULL) {
+    return false;
   }
-#endif
-
-  // Create a code cave
-  // The original argument for the width is only 8 bit (signed), so it's hard
-  // to extend. That's why we use a code cave.
-  uint32_t cave_memory_offset = memory_offset;
 
-  // Patches the arguments for the texture loader
-  memory_offset = push_u32(target, memory_offset, height);
-  memory_offset = push_u32(target, memory_offset, width);
-  memory_offset = push_u32(target, memory_offset, height);
-  memory_offset = push_u32(target, memory_offset, width);
-  memory_offset = jmp(target, memory_offset, code_end_offset);
+  // Read the entire file with a single read
+  fseek(image->f, 0, SEEK_END);
+  image->size = ftell(image->f);
+  fseek(image->f, 0, SEEK_SET);
+  image->data = malloc(image->size);
+  assert(image->data != NULL);
+  size_t read_count = fread(image->data, image->size, 1, image->f);
+  assert(read_count == 1);
+  image->content_size = image->size;
+  trace_access(false, 0, image->size);
+
+  return true;
+}
 
-  //FIXME: Fixup the format?
-  //.text:0042D794                 push    0
-  //.text:0042D796                 push    3
+static void resize_image(Image* image, size_t size) {
+  image->data = realloc(image->data, size);
+  assert(image->data != NULL);
+  if (size > image->size) {
+    memset(&image->data[image->size], 0x00, size - image->size);
+  }
+  image->size = size;
+  if (image->content_size > size) {
+    image->content_size = size;
+  }
+  return;
+}
 
-  // Write code to jump into the codecave (5 bytes) and clear original code
-  uint32_t hack_offset = jmp(target, code_begin_offset, cave_memory_offset);
-  printf("Tying to jump to 0x%08X\n", cave_memory_offset);
-  //FIXME: Use a while loop instead
-  for(unsigned int i = 5; i < (code_end_offset - code_begin_offset); i++) {
-    hack_offset = nop(target, hack_offset);
+static void close_image(Image* image) {
+
+  // Everything from the first to the last changed byte is written back at once, otherwise the whole file
+  if (image->dirty_valid) {
+    size_t begin = image->size;
+    size_t end = 0;
+    for(size_t i = 0; i < image->dirty_count; i++) {
+      FileRange* range = &image->dirty[i];
+      if (range->offset < begin) {
+        begin = range->offset;
+      }
+      if ((range->offset + range->size) > end) {
+        end = range->offset + range->size;
+      }
+    }
+    if (end > image->size) {
+      end = image->size;
+    }
+    if (begin < end) {
+      fseek(image->f, begin, SEEK_SET);
+      size_t write_count = fwrite(&image->data[begin], end - begin, 1, image->f);
+      assert(write_count == 1);
+      trace_access(true, begin, end - begin);
+    }
+  } else {
+    fseek(image->f, 0, SEEK_SET);
+    size_t write_count = fwrite(image->data, image->content_size, 1, image->f);
+    assert(write_count == 1);
+    trace_access(true, 0, image->content_size);
   }
+  fflush(image->f);
 
-  // Get number of textures in the table
-  uint32_t count = read32(target, offset + 0);
+  // Padding which was never written is left to the filesystem (sparse)
+  int status = ftruncate(fileno(image->f), image->size);
+  assert(status == 0);
+  fclose(image->f);
 
-  // Have a buffer for pixeldata
-  unsigned int texture_size = width * height * 4 / 8;
-  uint8_t* buffer = malloc(texture_size);
+  free(image->data);
+  free(image->dirty);
+  return;
+}
 
-  // Loop over all textures
-  for(unsigned int i = 0; i < count; i++) {
+// Closes the file without writing anything back
+static void discard_image(Image* image) {
+  fclose(image->f);
+  free(image->data);
+  free(image->dirty);
+  return;
+}
 
-    // Load input texture to buffer
-    char path[4096];
-    sprintf(path, "textures/%s_%d_test.data", filename, i);
-    printf("Loading '%s'\n", path);
-    FILE* ft = fopen(path, "rb");
-    assert(ft != NULL);
-    memset(buffer, 0x00, texture_size);
-    for(unsigned int i = 0; i < texture_size * 2; i++) {
-      uint8_t pixel[2]; // GIMP only exports Gray + Alpha..
-      fread(pixel, sizeof(pixel), 1, ft);
-      buffer[i / 2] |= (pixel[0] & 0xF0) >> ((i % 2) * 4);
-    }
-    fclose(ft);
-
-    // Write pixel data to game
-    uint32_t texture_new = memory_offset;
-    writex(target, memory_offset, buffer, texture_size);
-    memory_offset += texture_size;
+static void mark_dirty(Image* image, size_t offset, size_t size) {
 
-    // Patch the table entry
-    uint32_t texture_old = read32(target, offset + 4 + i * 4);
-    write32(target, offset + 4 + i * 4, texture_new);
-    printf("%d: 0x%X -> 0x%X\n", i, texture_old, texture_new);
+  // Writes arrive sorted by address, so neighbours are usually merged
+  if (image->dirty_count > 0) {
+    FileRange* last = &image->dirty[image->dirty_count - 1];
+    if ((offset >= last->offset) && (offset <= (last->offset + last->size))) {
+      if ((offset + size) > (last->offset + last->size)) {
+        last->size = offset + size - last->offset;
+      }
+      return;
+    }
   }
-  free(buffer);
-
-  return memory_offset;
+  if (image->dirty_count == image->dirty_capacity) {
+    image->dirty_capacity = image->dirty_capacity ? image->dirty_capacity * 2 : 64;
+    image->dirty = realloc(image->dirty, image->dirty_capacity * sizeof(FileRange));
+    assert(image->dirty != NULL);
+  }
+  image->dirty[image->dirty_count].offset = offset;
+  image->dirty[image->dirty_count].size = size;
+  image->dirty_count++;
+  return;
 }
 
-static void modify_network_guid(Target target, const void* data, size_t size) {
-
-  // Patches the game GUID so people don't cheat with it (as easily)
-
-  if (size == 0) {
-    size = strlen(data);
+static void writex(Target target, off_t offset, const void* data, size_t size) {
+  off_t file_offset = mapExe(target.image, offset);
+  if ((file_offset < 0) || ((file_offset + size) > target.image->size)) {
+    plan_error(target.plan, "Address 0x%08X is not in any section of the file", (uint32_t)offset);
+    return;
+  }
+  memcpy(&target.image->data[file_offset], data, size);
+  if ((file_offset + size) > target.image->content_size) {
+    target.image->content_size = file_offset + size;
   }
+  mark_dirty(target.image, file_offset, size);
+  trace_access(true, file_offset, size);
+  return;
+}
 
-  #define SWAP(a, b) if (a ^ b) {a ^= b; b ^= a; a ^= b;}
+static void readx(Target target, off_t offset, void* data, size_t size) {
+  off_t file_offset = mapExe(target.image, offset);
+  if ((file_offset < 0) || ((file_offset + size) > target.image->size)) {
+    plan_error(target.plan, "Address 0x%08X is not in any section of the file", (uint32_t)offset);
+    memset(data, 0x00, size);
+    return;
+  }
+  memcpy(data, &target.image->data[file_offset], size);
+  trace_access(false, file_offset, size);
+  return;
+}
 
-  static uint8_t s[256];
-  static bool initialized = false;
-  if (!initialized) {
+#endif
 
-    // Initialize the RC4 S-Box
-    for (int i = 0; i < 256; i++) {
-      s[i] = i;
+static uint32_t align_up(uint32_t value, uint32_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+#if defined(REMOTE)
+
+// Writes all blocks with a single gather write (per IOV_MAX blocks)
+static void write_blocks(Target target, const WriteBlock* blocks, size_t count) {
+  struct iovec local[1024];
+  struct iovec remote[1024];
+  size_t i = 0;
+  while(i < count) {
+    size_t batch = count - i;
+    if (batch > (sizeof(local) / sizeof(local[0]))) {
+      batch = sizeof(local) / sizeof(local[0]);
+    }
+    size_t size = 0;
+    for(size_t k = 0; k < batch; k++) {
+      local[k].iov_base = (void*)blocks[i + k].data;
+      local[k].iov_len = blocks[i + k].size;
+      remote[k].iov_base = (void*)(uintptr_t)blocks[i + k].address;
+      remote[k].iov_len = blocks[i + k].size;
+      size += blocks[i + k].size;
     }
+    ssize_t written = process_vm_writev(target.process->pid, local, batch, remote, batch, 0);
+    assert(written == (ssize_t)size);
+    backend_stats.write_count++;
+
+    // Read everything back in one go, so transfer bugs are caught by the harness
+    uint8_t* check = malloc(size);
+    assert(check != NULL);
+    struct iovec check_local = { check, size };
+    ssize_t read_size = process_vm_readv(target.process->pid, &check_local, 1, remote, batch, 0);
+    assert(read_size == (ssize_t)size);
+    backend_stats.read_count++;
+    uint8_t* cursor = check;
+    for(size_t k = 0; k < batch; k++) {
+      assert(!memcmp(cursor, local[k].iov_base, local[k].iov_len));
+      cursor += local[k].iov_len;
+    }
+    free(check);
 
-    initialized = true;
+    i += batch;
   }
 
-  // Modify the hash using RC4 schedule
-  assert(size <= 256);
-  const uint8_t* data_bytes = data;
-  uint8_t j = 0;
-  for (int i = 0; i < 256; i++) {
-    j += s[i] + data_bytes[i % size];
-    SWAP(s[i], s[j]);
+  printf("Wrote %zu blocks with %u write calls (%u read calls so far)\n", count, backend_stats.write_count, backend_stats.read_count);
+  return;
+}
+
+#elif defined(IN_PROCESS) || defined(LOADER)
+
+// Writes all blocks, but changes the protection of each page only once
+static void write_blocks(Target target, const WriteBlock* blocks, size_t count) {
+  size_t i = 0;
+  while(i < count) {
+
+    // Take all blocks which fall into the same run of pages with equal protection
+    uint32_t begin = blocks[i].address & ~0xFFF;
+    uint32_t run_end;
+    Protection protection = query_protection(target, begin, &run_end);
+    uint32_t end = align_up(blocks[i].address + blocks[i].size, 0x1000);
+    size_t j = i + 1;
+    while((j < count) && (blocks[j].address < ((end > run_end) ? end : run_end))) {
+      uint32_t block_end = align_up(blocks[j].address + blocks[j].size, 0x1000);
+      if (block_end > end) {
+        end = block_end;
+      }
+      j++;
+    }
+
+    // Blocks might reach into the next run, so remember all original protections
+    struct {
+      uint32_t address;
+      uint32_t size;
+      Protection protection;
+    } runs[16];
+    unsigned int run_count = 0;
+    uint32_t address = begin;
+    while(true) {
+      assert(run_count < (sizeof(runs) / sizeof(runs[0])));
+      uint32_t run_size = ((run_end < end) ? run_end : end) - address;
+      runs[run_count].address = address;
+      runs[run_count].size = run_size;
+      runs[run_count].protection = protection;
+      run_count++;
+      address += run_size;
+      if (address >= end) {
+        break;
+      }
+      protection = query_protection(target, address, &run_end);
+    }
+
+    set_protection(target, begin, end - begin, PROTECTION_WRITABLE);
+    write_run(target, &blocks[i], j - i);
+    for(unsigned int k = 0; k < run_count; k++) {
+      set_protection(target, runs[k].address, runs[k].size, runs[k].protection);
+    }
+
+    i = j;
   }
 
-  // Emit 16 bytes of the keystream
-  uint8_t k_i = 0;
-  uint8_t k_j = 0;
-  uint8_t k_s[256];
-  memcpy(k_s, s, 256);
-  for(int i = 0; i < 16; i++) {
-    k_j += k_s[++k_i];
-    SWAP(k_s[k_i], k_s[k_j]);
-    uint8_t rc4_output = k_s[(k_s[k_i] + k_s[k_j]) & 0xFF];
-    write8(target, 0x4AF9B0 + i, rc4_output);
+  printf("Wrote %zu blocks with %u protection changes, %u protection queries and %u write calls\n",
+         count, backend_stats.protect_count, backend_stats.query_count, backend_stats.write_count);
+  return;
+}
+
+#else
+
+static void write_blocks(Target target, const WriteBlock* blocks, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    writex(target, blocks[i].address, blocks[i].data, blocks[i].size);
   }
+  return;
+}
 
-  // Overwrite the first 2 byte with a version index, so we have room
-  // to fix the algorithm if we have messed up
-  write16(target, 0x4AF9B0 + 0, 0x00000000);
+#endif
 
+static void init_plan(Plan* plan) {
+  memset(plan, 0x00, sizeof(Plan));
+  plan->patch = "unknown";
   return;
 }
 
-static uint32_t patch_network_upgrades(Target target, uint32_t memory_offset, uint8_t* upgrade_levels, uint8_t* upgrade_healths) {
-  // Upgrade network play updates to 100%
+static void free_plan(Plan* plan) {
+  free(plan->records);
+  free(plan->data);
+  free(plan->owned);
+  return;
+}
 
-  modify_network_guid(target, "Upgrades", 0);
-  modify_network_guid(target, upgrade_levels, 7);
-  modify_network_guid(target, upgrade_healths, 7);
+// Sets the name of the patch that owns the following records
+static void begin_patch(Target target, const char* name) {
+  target.plan->patch = name;
+  if (!target.plan->measuring) {
+    trace_stage(name);
+  }
+  return;
+}
 
-  // The following patch only supports the same upgrade level and health for menus
-  // So in order to keep everything synchronized, we assert that only one setting is present for all categories
-  for(int i = 0; i < 7; i++) {
-    assert(upgrade_levels[i] == upgrade_levels[0]);
-    assert(upgrade_healths[i] == upgrade_healths[0]);
+
+// Index of the first owned range which ends after the address
+static size_t find_owned_range(const Plan* plan, uint32_t address) {
+  size_t low = 0;
+  size_t high = plan->owned_count;
+  while(low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (plan->owned[middle].end <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
+  return low;
+}
 
-  // Now do the actual upgrade for menus
-  write8(target, 0x45CFC6, upgrade_levels[0]);
-  write8(target, 0x45CFCB, upgrade_healths[0]);
+// Name of the patch which wrote the byte at this address, or NULL if it's untouched
+static const char* find_owner(const Plan* plan, uint32_t address) {
+  size_t i = find_owned_range(plan, address);
+  if ((i < plan->owned_count) && (plan->owned[i].begin <= address)) {
+    return plan->owned[i].patch;
+  }
+  return NULL;
+}
 
-  //FIXME: Upgrade network player creation
+// Records that the current patch owns these bytes; a patch may only overwrite its own bytes.
+// Returns false if the bytes belong to another patch, the index is left as it was then.
+static bool claim_range(Plan* plan, uint32_t begin, uint32_t end) {
+  size_t i = find_owned_range(plan, begin);
+  for(size_t j = i; (j < plan->owned_count) && (plan->owned[j].begin < end); j++) {
+    OwnedRange* range = &plan->owned[j];
+    if (strcmp(range->patch, plan->patch)) {
+      plan_error(plan, "Patch '%s' writes 0x%08X-0x%08X, which overlaps 0x%08X-0x%08X of patch '%s'",
+                 plan->patch, begin, end - 1, range->begin, range->end - 1, range->patch);
+      return false;
+    }
+  }
 
-  // 0x45B725 vs 0x45B9FF
+  // Overlapping and adjacent ranges of the same patch are merged
+  if ((i > 0) && (plan->owned[i - 1].end == begin) && !strcmp(plan->owned[i - 1].patch, plan->patch)) {
+    i--;
+  }
+  size_t j = i;
+  while((j < plan->owned_count) && (plan->owned[j].begin <= end) && !strcmp(plan->owned[j].patch, plan->patch)) {
+    if (plan->owned[j].begin < begin) {
+      begin = plan->owned[j].begin;
+    }
+    if (plan->owned[j].end > end) {
+      end = plan->owned[j].end;
+    }
+    j++;
+  }
 
-  #if 0
-  lea     edx, [esp+1Ch+upgrade_health]
-  lea     eax, [esp+1Ch+upgrade_level]
-  push    edx             ; upgrade_healths
-  push    eax             ; upgrade_levels
-  push    ebp             ; handling_in
-  push    offset handling_out ; handling_out
-  mov     [esp+esi+2Ch+upgrade_health], cl
-  call    _sub_449D00_generate_upgraded_handling_table_data
-  #endif
+  // Replace the merged ranges with a single one
+  if (i == j) {
+    if (plan->owned_count == plan->owned_capacity) {
+      plan->owned_capacity = plan->owned_capacity ? plan->owned_capacity * 2 : 256;
+      plan->owned = realloc(plan->owned, plan->owned_capacity * sizeof(OwnedRange));
+      assert(plan->owned != NULL);
+    }
+    memmove(&plan->owned[i + 1], &plan->owned[i], (plan->owned_count - i) * sizeof(OwnedRange));
+    plan->owned_count++;
+  } else {
+    memmove(&plan->owned[i + 1], &plan->owned[j], (plan->owned_count - j) * sizeof(OwnedRange));
+    plan->owned_count -= j - i - 1;
+  }
+  plan->owned[i].begin = begin;
+  plan->owned[i].end = end;
+  plan->owned[i].patch = plan->patch;
+  return true;
+}
 
-  // Place upgrade data in memory
+static void plan_write(Target target, PatchKind kind, off_t offset, const void* data, size_t size) {
+  Plan* plan = target.plan;
 
-  uint32_t memory_offset_upgrade_levels = memory_offset;
-  writex(target, memory_offset, upgrade_levels, 7);
-  memory_offset += 7;
+  if ((size == 0) || !claim_range(plan, offset, offset + size)) {
+    return;
+  }
+  if (trace.enabled) {
+    trace.counters.plan_count++;
+    trace.counters.plan_size += size;
+  }
 
-  uint32_t memory_offset_upgrade_healths = memory_offset;
-  writex(target, memory_offset, upgrade_healths, 7);
-  memory_offset += 7;
+  if (plan->record_count == plan->record_capacity) {
+    plan->record_capacity = plan->record_capacity ? plan->record_capacity * 2 : 256;
+    plan->records = realloc(plan->records, plan->record_capacity * sizeof(PatchRecord));
+    assert(plan->records != NULL);
+  }
+  while ((plan->data_size + size) > plan->data_capacity) {
+    plan->data_capacity = plan->data_capacity ? plan->data_capacity * 2 : 0x10000;
+    plan->data = realloc(plan->data, plan->data_capacity);
+    assert(plan->data != NULL);
+  }
 
+  PatchRecord* record = &plan->records[plan->record_count];
+  record->address = offset;
+  record->size = size;
+  record->data_offset = plan->data_size;
+  record->index = plan->record_count;
+  record->kind = kind;
+  record->patch = plan->patch;
+  memcpy(&plan->data[plan->data_size], data, size);
+
+  plan->record_count++;
+  plan->data_size += size;
+  return;
+}
 
-  // Now inject the code
+// Reads from the target, as if the plan had already been applied
+static void plan_read(Target target, off_t offset, void* data, size_t size) {
+  Plan* plan = target.plan;
+  readx(target, offset, data, size);
 
-  uint32_t memory_offset_upgrade_code = memory_offset;
+  uint32_t begin = offset;
+  uint32_t end = offset + size;
 
-  //  -> push edx
-  write8(target, memory_offset, 0x52); memory_offset += 1;
+  // Most reads don't touch anything which has been written
+  size_t owned = find_owned_range(plan, begin);
+  if ((owned == plan->owned_count) || (plan->owned[owned].begin >= end)) {
+    return;
+  }
+  for(size_t i = 0; i < plan->record_count; i++) {
+    PatchRecord* record = &plan->records[i];
+    uint32_t record_end = record->address + record->size;
+    if ((record->address >= end) || (record_end <= begin)) {
+      continue;
+    }
+    uint32_t overlap_begin = (record->address > begin) ? record->address : begin;
+    uint32_t overlap_end = (record_end < end) ? record_end : end;
+    memcpy((uint8_t*)data + (overlap_begin - begin),
+           &plan->data[record->data_offset + (overlap_begin - record->address)],
+           overlap_end - overlap_begin);
+  }
+  return;
+}
 
-  //  -> push eax
-  write8(target, memory_offset, 0x50); memory_offset += 1;
+static int compare_records_by_address(const void* a, const void* b) {
+  const PatchRecord* ra = a;
+  const PatchRecord* rb = b;
+  if (ra->address != rb->address) {
+    return (ra->address < rb->address) ? -1 : 1;
+  }
+  return (ra->index < rb->index) ? -1 : (ra->index > rb->index);
+}
 
-  //  -> push offset upgrade_healths
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, memory_offset_upgrade_healths); memory_offset += 4;
+static int compare_records_by_index(const void* a, const void* b) {
+  const PatchRecord* ra = a;
+  const PatchRecord* rb = b;
+  return (ra->index < rb->index) ? -1 : (ra->index > rb->index);
+}
 
-  //  -> push offset upgrade_levels
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, memory_offset_upgrade_levels); memory_offset += 4;
+// Merges adjacent and overlapping records and writes each block to the target.
+// Nothing is written if planning failed.
+static bool apply_plan(Target target) {
+  Plan* plan = target.plan;
+  if (plan->failed) {
+    return false;
+  }
 
-  //  -> push esi
-  write8(target, memory_offset, 0x56); memory_offset += 1;
+  PatchRecord* records = malloc(plan->record_count * sizeof(PatchRecord));
+  assert((records != NULL) || (plan->record_count == 0));
+  memcpy(records, plan->records, plan->record_count * sizeof(PatchRecord));
+  qsort(records, plan->record_count, sizeof(PatchRecord), compare_records_by_address);
+
+  // Merged blocks are never larger than the records they were made from
+  uint8_t* block_data = malloc(plan->data_size);
+  assert((block_data != NULL) || (plan->data_size == 0));
+  WriteBlock* blocks = malloc(plan->record_count * sizeof(WriteBlock));
+  assert((blocks != NULL) || (plan->record_count == 0));
+  size_t block_data_size = 0;
+  unsigned int write_count = 0;
+  size_t write_size = 0;
+
+  size_t i = 0;
+  while(i < plan->record_count) {
+
+    // Find all records which touch this block
+    uint32_t begin = records[i].address;
+    uint32_t end = begin + records[i].size;
+    size_t j = i + 1;
+    while((j < plan->record_count) && (records[j].address <= end)) {
+      uint32_t record_end = records[j].address + records[j].size;
+      if (record_end > end) {
+        end = record_end;
+      }
+      j++;
+    }
 
-  //  -> push edi
-  write8(target, memory_offset, 0x57); memory_offset += 1;
+    // Later records win if they overlap, so replay them in program order
+    qsort(&records[i], j - i, sizeof(PatchRecord), compare_records_by_index);
+    uint8_t* block = &block_data[block_data_size];
+    for(size_t k = i; k < j; k++) {
+      memcpy(&block[records[k].address - begin], &plan->data[records[k].data_offset], records[k].size);
+    }
 
-  //  -> call _sub_449D00
-  write8(target, memory_offset, 0xE8); memory_offset += 1;
-  write32(target, memory_offset, 0x449D00 - (memory_offset + 4)); memory_offset += 4;
+    WriteBlock* write = &blocks[write_count];
+    write->address = begin;
+    write->size = end - begin;
+    write->data = block;
+    block_data_size += end - begin;
+    write_count++;
+    write_size += end - begin;
 
-  //  -> add esp, 0x10
-  write8(target, memory_offset, 0x83); memory_offset += 1;
-  write8(target, memory_offset, 0xC4); memory_offset += 1;
-  write8(target, memory_offset, 0x10); memory_offset += 1;
+    i = j;
+  }
 
-  //  -> pop eax
-  write8(target, memory_offset, 0x58); memory_offset += 1;
+  write_blocks(target, blocks, write_count);
 
-  //  -> pop edx
-  write8(target, memory_offset, 0x5A); memory_offset += 1;
+  free(blocks);
+  free(block_data);
+  free(records);
 
-  //  -> retn
-  write8(target, memory_offset, 0xC3); memory_offset += 1;
+  // Writes which missed the file fail the whole exe
+  if (plan->failed) {
+    return false;
+  }
 
+  // Report what each patch contributed
+  for(size_t i = 0; i < plan->record_count; i++) {
+    const char* patch = plan->records[i].patch;
+
+    // Only report each patch once
+    bool reported = false;
+    for(size_t j = 0; j < i; j++) {
+      if (!strcmp(plan->records[j].patch, patch)) {
+        reported = true;
+        break;
+      }
+    }
+    if (reported) {
+      continue;
+    }
 
-  // Install it by jumping from 0x45B765 and returning to 0x45B76C
+    unsigned int counts[3] = { 0, 0, 0 };
+    size_t sizes[3] = { 0, 0, 0 };
+    for(size_t j = i; j < plan->record_count; j++) {
+      PatchRecord* record = &plan->records[j];
+      if (!strcmp(record->patch, patch)) {
+        counts[record->kind]++;
+        sizes[record->kind] += record->size;
+      }
+    }
+    printf("Patch '%s': %u code records (%zu bytes), %u data records (%zu bytes), %u pointer records (%zu bytes)\n",
+           patch,
+           counts[PATCH_CODE], sizes[PATCH_CODE],
+           counts[PATCH_DATA], sizes[PATCH_DATA],
+           counts[PATCH_POINTER], sizes[PATCH_POINTER]);
+  }
+  printf("Applied %zu records (%zu bytes) with %u writes (%zu bytes)\n",
+         plan->record_count, plan->data_size, write_count, write_size);
 
-  write8(target, 0x45B765 + 0, 0xE8);
-  write32(target, 0x45B765 + 1, memory_offset_upgrade_code - (0x45B765 + 5));
-  write8(target, 0x45B765 + 5, 0x90);
-  write8(target, 0x45B765 + 6, 0x90);
+  // Everything has been written, so the plan can start over
+  plan->record_count = 0;
+  plan->data_size = 0;
 
-  return memory_offset;
+  return true;
 }
 
-static uint32_t patch_network_collisions(Target target, uint32_t memory_offset) {
-  // Disable collision between network players
-
-  modify_network_guid(target, "Collisions", 0);
+// Lays out the arenas one after another.
+// Without capacities, each arena gets a default budget; only the last arena can grow freely.
+static void init_allocator(Allocator* allocator, uint32_t memory_offset, uint32_t page_size, const uint32_t* capacities) {
+
+  // Textures used to live in .data, so we keep them writeable.
+  static const Arena arenas[ARENA_COUNT] = {
+    [ARENA_CODE]     = { "hack",    16, 0x1000, 0x60000020 }, // Code, Executable, Readable
+    [ARENA_RODATA]   = { "hackro",   4, 0x1000, 0x40000040 }, // Initialized Data, Readable
+    [ARENA_DATA]     = { "hackrw",   4, 0x1000, 0xC0000040 }, // Initialized Data, Readable, Writeable
+    [ARENA_JOURNAL]  = { "hackundo", 4, 0x2000, 0x42000040 }, // Initialized Data, Discardable, Readable
+    [ARENA_TEXTURES] = { "hacktex", 16, 0,      0xC0000040 }  // Initialized Data, Readable, Writeable
+  };
+
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    Arena* arena = &allocator->arenas[i];
+    *arena = arenas[i];
+    if (capacities != NULL) {
+      arena->capacity = capacities[i];
+    }
+    arena->base = memory_offset;
+    arena->size = 0;
+    memory_offset += align_up(arena->capacity, page_size);
+  }
+  return;
+}
 
-  // Inject the code
+// Address where the next allocation in this arena would start
+static uint32_t arena_cursor(Target target, ArenaType type) {
+  Arena* arena = &target.allocator->arenas[type];
+  return arena->base + align_up(arena->size, arena->alignment);
+}
 
-  uint32_t memory_offset_collision_code = memory_offset;
+static uint32_t allocate(Target target, ArenaType type, uint32_t size) {
+  Arena* arena = &target.allocator->arenas[type];
+  uint32_t offset = align_up(arena->size, arena->alignment);
+  if ((type != (ARENA_COUNT - 1)) && ((offset + size) > arena->capacity)) {
+    plan_error(target.plan, "Arena '%s' is out of space (0x%X bytes requested, 0x%X of 0x%X used)",
+               arena->name, size, arena->size, arena->capacity);
+  }
+  arena->size = offset + size;
+  return arena->base + offset;
+}
 
-  memory_offset = push_edx(target, memory_offset);
+// End of the memory which is in use by the patches
+static uint32_t allocator_end(Allocator* allocator) {
+  Arena* last = &allocator->arenas[ARENA_COUNT - 1];
+  return last->base + last->size;
+}
 
-  // -> mov     edx, _dword_4D5E00_is_multiplayer
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x15); memory_offset += 1;
-  write32(target, memory_offset, 0x4D5E00); memory_offset += 4;
+static void report_allocator(Allocator* allocator) {
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    Arena* arena = &allocator->arenas[i];
+    if ((i != (ARENA_COUNT - 1)) && (arena->capacity == 0)) {
+      printf("Arena '%s' is not used\n", arena->name);
+    } else if (i != (ARENA_COUNT - 1)) {
+      printf("Arena '%s' at 0x%08X: 0x%X of 0x%X bytes used (%u%%)\n",
+             arena->name, arena->base, arena->size, arena->capacity,
+             (unsigned int)((uint64_t)arena->size * 100 / arena->capacity));
+    } else {
+      printf("Arena '%s' at 0x%08X: 0x%X bytes used\n",
+             arena->name, arena->base, arena->size);
+    }
+  }
+  return;
+}
 
-  memory_offset = test_edx_edx(target, memory_offset);
-  memory_offset = pop_edx(target, memory_offset);
+#if defined(LOADER) || defined(HARNESS)
 
-  // -> jz _sub_47B0C0
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0x84); memory_offset += 1;
-  write32(target, memory_offset, 0x47B0C0 - (memory_offset + 4)); memory_offset += 4;
+// The arenas have to fit into the memory which was reserved for the patches
+static bool fits_reservation(Target target) {
+  uint32_t used = allocator_end(target.allocator) - target.allocator->arenas[0].base;
+  if (used > patch_size) {
+    plan_error(target.plan, "The patches need 0x%X bytes, but only 0x%X bytes are reserved", used, patch_size);
+    return false;
+  }
+  return true;
+}
 
-  memory_offset = retn(target, memory_offset);
+#endif
 
+#ifdef LOADER
 
-  // Install it by patching call at 0x47B5AF
+// Commits the memory which is used by each arena, with matching protection
+static void commit_arenas(Target target) {
+  if (!fits_reservation(target)) {
+    return;
+  }
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    Arena* arena = &target.allocator->arenas[i];
+    if (arena->size == 0) {
+      continue;
+    }
 
-  write32(target, 0x47B5AF + 1, memory_offset_collision_code - (0x47B5AF + 5));
+    DWORD protect;
+    if (arena->characteristics & 0x20000000) {
+      protect = PAGE_EXECUTE_READ;
+    } else if (arena->characteristics & 0x80000000) {
+      protect = PAGE_READWRITE;
+    } else {
+      protect = PAGE_READONLY;
+    }
 
-  return memory_offset;
+#ifdef DLL
+    void* address = VirtualAlloc((void*)(uintptr_t)arena->base, arena->size, MEM_COMMIT, protect);
+#else
+    void* address = VirtualAllocEx(target.process_information.hProcess, (void*)(uintptr_t)arena->base, arena->size, MEM_COMMIT, protect);
+#endif
+    assert(address != NULL);
+  }
+  return;
 }
 
-static uint32_t patch_audio_stream_quality(Target target, uint32_t memory_offset, uint32_t samplerate, uint8_t bits_per_sample, bool stereo) {
-  // Patch audio streaming quality
+#elif defined(HARNESS)
 
-  // Calculate a fitting buffer-size
-  uint32_t buffer_size = 2 * samplerate * (bits_per_sample / 8) * (stereo ? 2 : 1);
+// Makes the memory which is used by each arena accessible, with matching protection
+static void commit_arenas(Target target) {
+  if (!fits_reservation(target)) {
+    return;
+  }
+#ifdef REMOTE
+  // The child reserved its memory as accessible already
+  return;
+#endif
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    Arena* arena = &target.allocator->arenas[i];
+    if (arena->size == 0) {
+      continue;
+    }
 
-  // Patch audio stream source setting
-  write32(target, 0x423215, buffer_size);
-  write8(target, 0x42321A, bits_per_sample);
-  write32(target, 0x42321E, samplerate);
+    int protection = PROT_READ;
+    if (arena->characteristics & 0x20000000) {
+      protection |= PROT_EXEC;
+    }
+    if (arena->characteristics & 0x80000000) {
+      protection |= PROT_WRITE;
+    }
+    add_region(target.process, arena->base, align_up(arena->size, 0x1000), protection);
+  }
+  return;
+}
 
-  // Patch audio stream buffer chunk size
-  write32(target, 0x423549, buffer_size / 2);
-  write32(target, 0x42354E, buffer_size / 2);
-  write32(target, 0x423555, buffer_size / 2);
+#endif
 
-  return memory_offset;
+// Address of a site in the game version which is being patched
+static uint32_t site(Target target, Site site) {
+  uint32_t address = target.addresses->address[site];
+  if (address == 0) {
+    plan_error(target.plan, "Site '%s' is unknown for this version of the game", site_names[site]);
+  }
+  return address;
 }
 
-static uint32_t patch_sprite_loader_to_load_tga(Target target, uint32_t memory_offset) {
-  // Replace the sprite loader with a version that checks for "data\\images\\sprite-%d.tga"
+static uint8_t read8(Target target, off_t offset) {
+  uint8_t value;
+  plan_read(target, offset, &value, 1);
+  return value;
+}
 
-  // Write the path we want to use to the binary
-  const char* tga_path = "data\\sprites\\sprite-%d.tga";
+static void write8(Target target, off_t offset, uint8_t value) {
+  plan_write(target, PATCH_DATA, offset, &value, 1);
+  return;
+}
 
-  uint32_t memory_offset_tga_path = memory_offset;
-  writex(target, memory_offset, tga_path, strlen(tga_path) + 1);
-  memory_offset += strlen(tga_path) + 1;
+static uint16_t read16(Target target, off_t offset) {
+  uint16_t value;
+  plan_read(target, offset, &value, 2);
+  return value;
+}
 
+static void write16(Target target, off_t offset, uint16_t value) {
+  plan_write(target, PATCH_DATA, offset, &value, 2);
+  return;
+}
 
+static uint32_t read32(Target target, off_t offset) {
+  uint32_t value;
+  plan_read(target, offset, &value, 4);
+  return value;
+}
 
-  // FIXME: load_success: Yay! Shift down size, to compensate for higher resolution
-  uint32_t memory_offset_load_success = memory_offset;
-  #if 1
+static void write32(Target target, off_t offset, uint32_t value) {
+  plan_write(target, PATCH_DATA, offset, &value, 4);
+  return;
+}
 
-  // Shift the width and height of the sprite to the right
-  #if 1
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 0); memory_offset += 1;
-  write8(target, memory_offset, 1); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 14); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  #endif
+static void write_data(Target target, off_t offset, const void* data, size_t size) {
+  plan_write(target, PATCH_DATA, offset, data, size);
+  return;
+}
 
-  // Get address of page and repeat steps
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x50); memory_offset += 1;
-  write8(target, memory_offset, 16); memory_offset += 1;
+static void write_code8(Target target, off_t offset, uint8_t value) {
+  plan_write(target, PATCH_CODE, offset, &value, 1);
+  return;
+}
 
-  #if 1
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x6A); memory_offset += 1;
-  write8(target, memory_offset, 0); memory_offset += 1;
-  write8(target, memory_offset, 1); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x6A); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  #endif
+static void write_code32(Target target, off_t offset, uint32_t value) {
+  plan_write(target, PATCH_CODE, offset, &value, 4);
+  return;
+}
 
-  // Get address of texture and repeat steps
+static void write_pointer32(Target target, off_t offset, uint32_t value) {
+  plan_write(target, PATCH_POINTER, offset, &value, 4);
+  return;
+}
 
-  //0:  8b 50 10                mov    edx,DWORD PTR [eax+0x10]
-  //3:  66 c1 6a 02 02          shr    WORD PTR [edx+0x2],0x2
-  #endif
+static void patch16_add(Target target, off_t offset, uint16_t delta) {
+  write16(target, offset, read16(target, offset) + delta);
+  return;
+}
 
-  // finish: Clear stack and return
-  uint32_t memory_offset_finish = memory_offset;
-  memory_offset = add_esp(target, memory_offset, 0x4 + 0x400);
-  memory_offset = retn(target, memory_offset);
+static void patch32_add(Target target, off_t offset, uint32_t delta) {
+  write32(target, offset, read32(target, offset) + delta);
+  return;
+}
 
-  // Start of actual code
-  uint32_t memory_offset_tga_loader_code = memory_offset;
+// Code caves are assembled into a local buffer first, so branches can refer
+// to labels which are only bound later.
+typedef enum {
+  BRANCH_NONE,
+  BRANCH_CALL,
+  BRANCH_JMP,
+  BRANCH_JCC
+} BranchType;
 
-  // Read the sprite_index from stack
-  //  -> mov     eax, [esp+4]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x44); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
-  write8(target, memory_offset, 0x04); memory_offset += 1;
+typedef struct {
+  uint8_t bytes[16];
+  uint8_t size;
+  BranchType branch;
+  uint8_t condition;
+  int label;
+  uint32_t target_address;
+  bool rel32;
+  uint32_t address;
+} Instruction;
 
-  // Make room for sprintf buffer and keep the pointer in edx
-  //  -> add     esp, -400h
-  memory_offset = add_esp(target, memory_offset, -0x400);
-  //  -> mov     edx, esp
-  write8(target, memory_offset, 0x89); memory_offset += 1;
-  write8(target, memory_offset, 0xE2); memory_offset += 1;
+typedef struct {
+  Instruction instructions[128];
+  unsigned int instruction_count;
+  unsigned int labels[32];
+  unsigned int label_count;
+} Emitter;
+
+#define CONDITION_Z 0x4
+#define CONDITION_NZ 0x5
+
+static void init_emitter(Emitter* e) {
+  e->instruction_count = 0;
+  e->label_count = 0;
+  return;
+}
 
-  // Generate the path, keep sprite_index on stack as we'll keep using it
-  memory_offset = push_eax(target, memory_offset); // (sprite_index)
-  memory_offset = push_u32(target, memory_offset, memory_offset_tga_path); // (fmt)
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x49EB80); // sprintf
-  memory_offset = pop_edx(target, memory_offset); // (buffer)
-  memory_offset = add_esp(target, memory_offset, 0x4);
+static int new_label(Emitter* e) {
+  assert(e->label_count < (sizeof(e->labels) / sizeof(e->labels[0])));
+  e->labels[e->label_count] = ~0U;
+  return e->label_count++;
+}
 
-  // Attempt to load the TGA, then remove path from stack
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x4114D0); // load_sprite_from_tga_and_add_loaded_sprite
-  memory_offset = add_esp(target, memory_offset, 0x4);
+// Binds the label to the next instruction which will be emitted
+static void bind_label(Emitter* e, int label) {
+  e->labels[label] = e->instruction_count;
+  return;
+}
 
-  // Check if the load failed
-  memory_offset = test_eax_eax(target, memory_offset);
-  //  -> jnz load_success
-  memory_offset = jnz(target, memory_offset, memory_offset_load_success);
+static Instruction* new_instruction(Emitter* e) {
+  assert(e->instruction_count < (sizeof(e->instructions) / sizeof(e->instructions[0])));
+  Instruction* instruction = &e->instructions[e->instruction_count++];
+  memset(instruction, 0x00, sizeof(Instruction));
+  instruction->branch = BRANCH_NONE;
+  instruction->label = -1;
+  return instruction;
+}
 
-  // Load failed, so load the original sprite (sprite-index still on stack)
-  memory_offset = call(target, memory_offset, 0x446CA0); // load_sprite_internal
+static void emit(Emitter* e, const uint8_t* bytes, size_t size) {
+  Instruction* instruction = new_instruction(e);
+  assert(size <= sizeof(instruction->bytes));
+  memcpy(instruction->bytes, bytes, size);
+  instruction->size = size;
+  return;
+}
 
-  //  -> jmp finish
-  memory_offset = jmp(target, memory_offset, memory_offset_finish);
+#define EMIT(e, ...) emit(e, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
 
+static void emit_u32(Emitter* e, const uint8_t* opcode, size_t opcode_size, uint32_t value) {
+  uint8_t bytes[16];
+  memcpy(&bytes[0], opcode, opcode_size);
+  memcpy(&bytes[opcode_size], &value, 4);
+  emit(e, bytes, opcode_size + 4);
+  return;
+}
 
-  // Install it by jumping from 0x446FB0 (and we'll return directly)
-  jmp(target, 0x446FB0, memory_offset_tga_loader_code);
+static void emit_branch(Emitter* e, BranchType branch, uint8_t condition, int label, uint32_t address) {
+  Instruction* instruction = new_instruction(e);
+  instruction->branch = branch;
+  instruction->condition = condition;
+  instruction->label = label;
+  instruction->target_address = address;
 
-  return memory_offset;
+  // Calls only exist with a 32 bit displacement
+  instruction->rel32 = (branch == BRANCH_CALL);
+  return;
 }
 
-static uint32_t patch_trigger_display(Target target, uint32_t memory_offset) {
-  // Display triggers
+static unsigned int instruction_size(const Instruction* instruction) {
+  switch(instruction->branch) {
+  case BRANCH_NONE:
+    return instruction->size;
+  case BRANCH_CALL:
+    return 5;
+  case BRANCH_JMP:
+    return instruction->rel32 ? 5 : 2;
+  case BRANCH_JCC:
+    return instruction->rel32 ? 6 : 2;
+  default:
+    assert(false);
+    return 0;
+  }
+}
 
-  const char* trigger_string = "Trigger %d activated";
-  float trigger_string_display_duration = 3.0f;
+static uint32_t label_address(const Emitter* e, int label) {
+  unsigned int index = e->labels[label];
+  assert(index != ~0U);
+  if (index == e->instruction_count) {
+    const Instruction* last = &e->instructions[e->instruction_count - 1];
+    return last->address + instruction_size(last);
+  }
+  return e->instructions[index].address;
+}
 
-  uint32_t memory_offset_trigger_string = memory_offset;
-  writex(target, memory_offset, trigger_string, strlen(trigger_string));
-  memory_offset += strlen(trigger_string) + 1;
+static uint32_t branch_target(const Emitter* e, const Instruction* instruction) {
+  if (instruction->label == -1) {
+    return instruction->target_address;
+  }
+  return label_address(e, instruction->label);
+}
 
-  uint32_t memory_offset_trigger_code = memory_offset;
+// Places all instructions at the given address and picks the shortest
+// branch encodings which can reach their destination
+static uint32_t layout(Emitter* e, uint32_t memory_offset) {
+  for(unsigned int i = 0; i < e->instruction_count; i++) {
+    Instruction* instruction = &e->instructions[i];
+    instruction->rel32 = (instruction->branch == BRANCH_CALL);
+  }
 
-  // Read the trigger from stack
-  //  -> mov     eax, [esp+4]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x44); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
-  write8(target, memory_offset, 0x04); memory_offset += 1;
+  bool changed;
+  uint32_t end;
+  do {
+    end = memory_offset;
+    for(unsigned int i = 0; i < e->instruction_count; i++) {
+      e->instructions[i].address = end;
+      end += instruction_size(&e->instructions[i]);
+    }
 
-  // Get pointer to section 8
-  //0:  8b 40 4c                mov    eax,DWORD PTR [eax+0x4c]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x40); memory_offset += 1;
-  write8(target, memory_offset, 0x4C); memory_offset += 1;
+    // Branches only ever grow, so this will terminate
+    changed = false;
+    for(unsigned int i = 0; i < e->instruction_count; i++) {
+      Instruction* instruction = &e->instructions[i];
+      if ((instruction->branch == BRANCH_NONE) || instruction->rel32) {
+        continue;
+      }
+      int64_t displacement = (int64_t)branch_target(e, instruction) - (instruction->address + 2);
+      if ((displacement < -128) || (displacement > 127)) {
+        instruction->rel32 = true;
+        changed = true;
+      }
+    }
+  } while(changed);
+  return end;
+}
+
+static void encode(const Emitter* e, uint8_t* buffer, uint32_t memory_offset) {
+  for(unsigned int i = 0; i < e->instruction_count; i++) {
+    const Instruction* instruction = &e->instructions[i];
+    uint8_t* bytes = &buffer[instruction->address - memory_offset];
+    unsigned int size = instruction_size(instruction);
+    uint32_t displacement = branch_target(e, instruction) - (instruction->address + size);
+    switch(instruction->branch) {
+    case BRANCH_NONE:
+      memcpy(bytes, instruction->bytes, size);
+      break;
+    case BRANCH_CALL:
+      bytes[0] = 0xE8;
+      memcpy(&bytes[1], &displacement, 4);
+      break;
+    case BRANCH_JMP:
+      if (instruction->rel32) {
+        bytes[0] = 0xE9;
+        memcpy(&bytes[1], &displacement, 4);
+      } else {
+        bytes[0] = 0xEB;
+        bytes[1] = displacement;
+      }
+      break;
+    case BRANCH_JCC:
+      if (instruction->rel32) {
+        bytes[0] = 0x0F;
+        bytes[1] = 0x80 | instruction->condition;
+        memcpy(&bytes[2], &displacement, 4);
+      } else {
+        bytes[0] = 0x70 | instruction->condition;
+        bytes[1] = displacement;
+      }
+      break;
+    default:
+      assert(false);
+      break;
+    }
+  }
+  return;
+}
+
+static void set_add_esp(Instruction* instruction, int32_t n) {
+  if ((n >= -128) && (n <= 127)) {
+    instruction->bytes[0] = 0x83;
+    instruction->bytes[1] = 0xC4;
+    instruction->bytes[2] = (uint8_t)n;
+    instruction->size = 3;
+  } else {
+    instruction->bytes[0] = 0x81;
+    instruction->bytes[1] = 0xC4;
+    memcpy(&instruction->bytes[2], &n, 4);
+    instruction->size = 6;
+  }
+  return;
+}
+
+static bool is_add_esp(const Instruction* instruction, int32_t* n) {
+  if (instruction->branch != BRANCH_NONE) {
+    return false;
+  }
+  if ((instruction->size == 3) && (instruction->bytes[0] == 0x83) && (instruction->bytes[1] == 0xC4)) {
+    *n = (int8_t)instruction->bytes[2];
+    return true;
+  }
+  if ((instruction->size == 6) && (instruction->bytes[0] == 0x81) && (instruction->bytes[1] == 0xC4)) {
+    memcpy(n, &instruction->bytes[2], 4);
+    return true;
+  }
+  return false;
+}
+
+// Returns the register of a `push r32` or `pop r32`, or -1
+static int push_pop_register(const Instruction* instruction, uint8_t opcode) {
+  if ((instruction->branch != BRANCH_NONE) || (instruction->size != 1)) {
+    return -1;
+  }
+  if ((instruction->bytes[0] & 0xF8) != opcode) {
+    return -1;
+  }
+  int r = instruction->bytes[0] & 7;
+
+  // Pushing or popping esp has side effects we don't want to deal with
+  return (r == 4) ? -1 : r;
+}
+
+static bool is_label_target(const Emitter* e, unsigned int index) {
+  for(unsigned int i = 0; i < e->label_count; i++) {
+    if (e->labels[i] == index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void remove_instructions(Emitter* e, unsigned int index, unsigned int count) {
+  memmove(&e->instructions[index], &e->instructions[index + count],
+          (e->instruction_count - (index + count)) * sizeof(Instruction));
+  e->instruction_count -= count;
+  for(unsigned int i = 0; i < e->label_count; i++) {
+    if ((e->labels[i] != ~0U) && (e->labels[i] > index)) {
+      e->labels[i] -= count;
+    }
+  }
+  return;
+}
+
+// Whether the instruction at `index` reads the flags: jcc, setcc, cmovcc or pushf
+static bool reads_flags(const Emitter* e, unsigned int index) {
+  if (index >= e->instruction_count) {
+    return false;
+  }
+  const Instruction* instruction = &e->instructions[index];
+  if (instruction->branch == BRANCH_JCC) {
+    return true;
+  }
+  if (instruction->branch != BRANCH_NONE) {
+    return false;
+  }
+  if ((instruction->size >= 2) && (instruction->bytes[0] == 0x0F) &&
+      (((instruction->bytes[1] & 0xF0) == 0x90) || ((instruction->bytes[1] & 0xF0) == 0x40))) {
+    return true;
+  }
+  return (instruction->size == 1) && (instruction->bytes[0] == 0x9C);
+}
+
+// Folds instruction sequences into cheaper equivalents.
+// Flags are assumed to be dead after `add esp`, unless the next instruction reads them.
+static void optimize(Emitter* e) {
+  bool changed;
+  do {
+    changed = false;
+    for(unsigned int i = 0; i < e->instruction_count; i++) {
+      Instruction* instruction = &e->instructions[i];
+      unsigned int remaining = e->instruction_count - i;
+
+      // push r; mov r, [m32]; test r, r; pop r -> cmp dword [m32], 0
+      if ((remaining >= 4) && !is_label_target(e, i + 1) && !is_label_target(e, i + 2) && !is_label_target(e, i + 3)) {
+        int r = push_pop_register(&instruction[0], 0x50);
+        const Instruction* mov = &instruction[1];
+        const Instruction* test = &instruction[2];
+        if ((r != -1) &&
+            (mov->branch == BRANCH_NONE) && (mov->size == 6) &&
+            (mov->bytes[0] == 0x8B) && (mov->bytes[1] == (0x05 | (r << 3))) &&
+            (test->branch == BRANCH_NONE) && (test->size == 2) &&
+            (test->bytes[0] == 0x85) && (test->bytes[1] == (0xC0 | (r << 3) | r)) &&
+            (push_pop_register(&instruction[3], 0x58) == r)) {
+          uint8_t bytes[7] = { 0x83, 0x3D, 0, 0, 0, 0, 0x00 };
+          memcpy(&bytes[2], &mov->bytes[2], 4);
+          memcpy(instruction->bytes, bytes, sizeof(bytes));
+          instruction->size = sizeof(bytes);
+          remove_instructions(e, i + 1, 3);
+          changed = true;
+          continue;
+        }
+      }
+
+      // push r; pop r -> (nothing)
+      if ((remaining >= 2) && !is_label_target(e, i + 1)) {
+        int r = push_pop_register(&instruction[0], 0x50);
+        if ((r != -1) && (push_pop_register(&instruction[1], 0x58) == r)) {
+          remove_instructions(e, i, 2);
+          changed = true;
+          continue;
+        }
+      }
+
+      // add esp, a; add esp, b -> add esp, a + b
+      int32_t a;
+      int32_t b;
+      if ((remaining >= 2) && !is_label_target(e, i + 1) && !reads_flags(e, i + 2) &&
+          is_add_esp(&instruction[0], &a) && is_add_esp(&instruction[1], &b)) {
+        set_add_esp(instruction, a + b);
+        remove_instructions(e, i + 1, 1);
+        changed = true;
+        continue;
+      }
+
+      // add esp, 0 -> (nothing)
+      if (is_add_esp(instruction, &a) && (a == 0) && !reads_flags(e, i + 1)) {
+        remove_instructions(e, i, 1);
+        changed = true;
+        continue;
+      }
+    }
+  } while(changed);
+  return;
+}
+
+// Assembles the emitted code into the code arena and writes it in one go
+static uint32_t commit(Target target, Emitter* e) {
+  uint32_t memory_offset = arena_cursor(target, ARENA_CODE);
+
+  // Measure the code, then run the peephole optimizer and report the gains
+  unsigned int unoptimized_count = e->instruction_count;
+  uint32_t unoptimized_size = layout(e, memory_offset) - memory_offset;
+  optimize(e);
+
+  uint32_t end = layout(e, memory_offset);
+  patch_log(target.plan, "Cave for '%s': %u instructions (%u bytes) -> %u instructions (%u bytes)\n",
+         target.plan->patch,
+         unoptimized_count, unoptimized_size,
+         e->instruction_count, end - memory_offset);
+
+  uint8_t buffer[sizeof(e->instructions) / sizeof(e->instructions[0]) * 16];
+  encode(e, buffer, memory_offset);
+  plan_write(target, PATCH_CODE, memory_offset, buffer, end - memory_offset);
+
+  uint32_t address = allocate(target, ARENA_CODE, end - memory_offset);
+  assert(address == memory_offset);
+  return address;
+}
+
+// Same as commit, but overwrites `size` bytes of existing code and pads with nops
+static void commit_hook(Target target, Emitter* e, uint32_t address, uint32_t size) {
+  uint32_t end = layout(e, address);
+  assert((end - address) <= size);
+  uint8_t buffer[sizeof(e->instructions) / sizeof(e->instructions[0]) * 16];
+  encode(e, buffer, address);
+  memset(&buffer[end - address], 0x90, size - (end - address));
+  plan_write(target, PATCH_CODE, address, buffer, size);
+  return;
+}
+
+static void add_esp(Emitter* e, int32_t n) {
+  set_add_esp(new_instruction(e), n);
+  return;
+}
+
+static void test_eax_eax(Emitter* e) {
+  EMIT(e, 0x85, 0xC0);
+  return;
+}
+
+static void test_edx_edx(Emitter* e) {
+  EMIT(e, 0x85, 0xD2);
+  return;
+}
+
+static void push_eax(Emitter* e) {
+  EMIT(e, 0x50);
+  return;
+}
+
+static void push_edx(Emitter* e) {
+  EMIT(e, 0x52);
+  return;
+}
+
+static void push_esi(Emitter* e) {
+  EMIT(e, 0x56);
+  return;
+}
+
+static void push_edi(Emitter* e) {
+  EMIT(e, 0x57);
+  return;
+}
+
+static void pop_eax(Emitter* e) {
+  EMIT(e, 0x58);
+  return;
+}
+
+static void pop_edx(Emitter* e) {
+  EMIT(e, 0x5A);
+  return;
+}
+
+static void push_u32(Emitter* e, uint32_t value) {
+  emit_u32(e, (const uint8_t[]){ 0x68 }, 1, value);
+  return;
+}
+
+static void call(Emitter* e, uint32_t address) {
+  emit_branch(e, BRANCH_CALL, 0, -1, address);
+  return;
+}
+
+static void jmp(Emitter* e, uint32_t address) {
+  emit_branch(e, BRANCH_JMP, 0, -1, address);
+  return;
+}
+
+static void jmp_label(Emitter* e, int label) {
+  emit_branch(e, BRANCH_JMP, 0, label, 0);
+  return;
+}
+
+static void jz(Emitter* e, uint32_t address) {
+  emit_branch(e, BRANCH_JCC, CONDITION_Z, -1, address);
+  return;
+}
+
+static void jnz_label(Emitter* e, int label) {
+  emit_branch(e, BRANCH_JCC, CONDITION_NZ, label, 0);
+  return;
+}
+
+static void retn(Emitter* e) {
+  EMIT(e, 0xC3);
+  return;
+}
+
+#if 0
+
+static void* readExe(Target target, uint32_t offset, size_t size) {
+
+  // Find correct location in binary
+  offset = offset;
+
+  // Allocate space for the read
+  void* data = malloc(size);
+
+  // Read the data from the exe
+  off_t previous_offset = ftell(f);
+  fseek(target, offset, SEEK_SET);
+  fread(data, size, 1, f);
+  fseek(target, previous_offset, SEEK_SET);
+
+  return data;
+}
+
+static void dumpTexture(Target target, size_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
+  // Presumably the format information?
+  assert(unk0 == 3);
+  assert(unk1 == 0);
+
+  FILE* out = fopen(filename, "wb");
+  fprintf(out, "P3\n%d %d\n15\n", width, height);
+
+  // Copy the pixel data
+  uint8_t* texture = readExe(target, offset, width * height * 4 / 8);
+  for(unsigned int i = 0; i < width * height * 2; i++) {
+    uint8_t v = ((texture[i / 2] << ((i % 2) * 4)) & 0xF0) >> 4;
+    fprintf(out, "%d %d %d\n", v, v, v);
+  }
+  free(texture);
+
+  fclose(out);
+  return;
+}
+
+static uint32_t dumpTextureTable(Target target, uint32_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
+  char filename_i[4096]; //FIXME: Size
+
+  // Get size of the table
+  uint32_t* buffer = readExe(target, offset + 0, 4);
+  uint32_t count = *buffer;
+  free(buffer);
+
+  // Loop over elements and dump each
+  printf("// %s at 0x%X\n", filename, offset);
+  uint32_t* offsets = readExe(target, offset + 4, count * 4);
+  for(unsigned int i = 0; i < count; i++) {
+    sprintf(filename_i, "%s_%d.ppm", filename, i);
+    printf("// - [%d]: 0x%X\n", i, offsets[i]);
+    dumpTexture(target, offsets[i], unk0, unk1, width, height, filename_i);
+  }
+  free(offsets);
+  return count;
+}
+
+#endif
+
+// XXH64, used to checksum the texture pack
+#define HASH64_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_PRIME3 0x165667B19E3779F9ULL
+#define HASH64_PRIME4 0x85EBCA77C2B2CA63ULL
+#define HASH64_PRIME5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t length;
+  uint8_t buffer[32];
+  size_t buffered;
+} Hash64;
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static uint64_t hash64_round(uint64_t acc, uint64_t input) {
+  acc += input * HASH64_PRIME2;
+  acc = rotl64(acc, 31);
+  return acc * HASH64_PRIME1;
+}
+
+static uint64_t hash64_merge(uint64_t acc, uint64_t v) {
+  acc ^= hash64_round(0, v);
+  return acc * HASH64_PRIME1 + HASH64_PRIME4;
+}
+
+static void hash64_init(Hash64* h, uint64_t seed) {
+  memset(h, 0x00, sizeof(Hash64));
+  h->seed = seed;
+  h->v[0] = seed + HASH64_PRIME1 + HASH64_PRIME2;
+  h->v[1] = seed + HASH64_PRIME2;
+  h->v[2] = seed;
+  h->v[3] = seed - HASH64_PRIME1;
+  return;
+}
+
+static void hash64_update(Hash64* h, const void* data, size_t size) {
+  const uint8_t* p = data;
+  h->length += size;
+
+  // Keep collecting until we have a full stripe
+  if ((h->buffered + size) < 32) {
+    memcpy(&h->buffer[h->buffered], p, size);
+    h->buffered += size;
+    return;
+  }
+  if (h->buffered > 0) {
+    size_t fill = 32 - h->buffered;
+    memcpy(&h->buffer[h->buffered], p, fill);
+    for(int i = 0; i < 4; i++) {
+      h->v[i] = hash64_round(h->v[i], load64(&h->buffer[i * 8]));
+    }
+    p += fill;
+    size -= fill;
+    h->buffered = 0;
+  }
+
+  while(size >= 32) {
+    for(int i = 0; i < 4; i++) {
+      h->v[i] = hash64_round(h->v[i], load64(&p[i * 8]));
+    }
+    p += 32;
+    size -= 32;
+  }
+
+  memcpy(h->buffer, p, size);
+  h->buffered = size;
+  return;
+}
+
+static uint64_t hash64_final(const Hash64* h) {
+  uint64_t acc;
+  if (h->length >= 32) {
+    acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+    for(int i = 0; i < 4; i++) {
+      acc = hash64_merge(acc, h->v[i]);
+    }
+  } else {
+    acc = h->seed + HASH64_PRIME5;
+  }
+  acc += h->length;
+
+  // Mix in the bytes which didn't fill a stripe
+  const uint8_t* p = h->buffer;
+  size_t size = h->buffered;
+  while(size >= 8) {
+    acc ^= hash64_round(0, load64(p));
+    acc = rotl64(acc, 27) * HASH64_PRIME1 + HASH64_PRIME4;
+    p += 8;
+    size -= 8;
+  }
+  if (size >= 4) {
+    uint32_t k;
+    memcpy(&k, p, 4);
+    acc ^= (uint64_t)k * HASH64_PRIME1;
+    acc = rotl64(acc, 23) * HASH64_PRIME2 + HASH64_PRIME3;
+    p += 4;
+    size -= 4;
+  }
+  while(size > 0) {
+    acc ^= (uint64_t)*p * HASH64_PRIME5;
+    acc = rotl64(acc, 11) * HASH64_PRIME1;
+    p++;
+    size--;
+  }
+
+  acc ^= acc >> 33;
+  acc *= HASH64_PRIME2;
+  acc ^= acc >> 29;
+  acc *= HASH64_PRIME3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+static uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+  Hash64 h;
+  hash64_init(&h, seed);
+  hash64_update(&h, data, size);
+  return hash64_final(&h);
+}
+
+static void hash_memory(Target target, Hash64* h, uint32_t address, uint32_t size) {
+  uint8_t buffer[0x1000];
+  while(size > 0) {
+    uint32_t chunk = (size < sizeof(buffer)) ? size : sizeof(buffer);
+    readx(target, address, buffer, chunk);
+    hash64_update(h, buffer, chunk);
+    address += chunk;
+    size -= chunk;
+  }
+  return;
+}
+
+// Fingerprint of the headers and code sections, which identifies a build.
+// The data sections are left out, as the game modifies them while it runs.
+static uint64_t fingerprint_image(Target target, uint32_t image_base) {
+  uint32_t coff_header = image_base + read32(target, image_base + 0x3C) + 4;
+  uint32_t optional_header = coff_header + 20;
+  uint32_t section_header = optional_header + read16(target, coff_header + 16);
+  uint16_t section_count = read16(target, coff_header + 2);
+
+  Hash64 h;
+  hash64_init(&h, 0);
+  hash_memory(target, &h, image_base, read32(target, optional_header + 60));
+  for(int i = 0; i < section_count; i++) {
+    uint32_t header = section_header + i * 40;
+    if (!(read32(target, header + 36) & 0x20)) {
+      continue;
+    }
+    uint32_t virtual_size = read32(target, header + 8);
+    uint32_t size = read32(target, header + 16);
+    if ((virtual_size != 0) && (virtual_size < size)) {
+      size = virtual_size;
+    }
+    hash_memory(target, &h, image_base + read32(target, header + 12), size);
+  }
+  return hash64_final(&h);
+}
+
+// Finds the version by fingerprint, the timestamp has to match too.
+// Versions which don't list any fingerprints yet are matched by their timestamp alone.
+static const Version* find_version(uint32_t timestamp, uint64_t fingerprint) {
+  const unsigned int version_count = sizeof(versions) / sizeof(versions[0]);
+  for(unsigned int i = 0; i < version_count; i++) {
+    for(unsigned int j = 0; j < versions[i].fingerprint_count; j++) {
+      if ((versions[i].fingerprints[j] == fingerprint) && (versions[i].timestamp == timestamp)) {
+        return &versions[i];
+      }
+    }
+  }
+  for(unsigned int i = 0; i < version_count; i++) {
+    if ((versions[i].fingerprint_count == 0) && (versions[i].timestamp == timestamp)) {
+      printf("Version '%s' has no fingerprints yet, it was only matched by its timestamp\n", versions[i].name);
+      return &versions[i];
+    }
+  }
+  return NULL;
+}
+
+// Explains why an exe wasn't detected, a known timestamp means it's a variant we haven't seen
+static void print_unknown_version(uint32_t timestamp, uint64_t fingerprint) {
+  printf("Unknown version of the game, timestamp 0x%08X, fingerprint %016llX\n", timestamp, (unsigned long long)fingerprint);
+  const unsigned int version_count = sizeof(versions) / sizeof(versions[0]);
+  for(unsigned int i = 0; i < version_count; i++) {
+    if (versions[i].timestamp == timestamp) {
+      printf("The timestamp is the one of version '%s', but the fingerprint is not\n", versions[i].name);
+    }
+  }
+  return;
+}
+
+// Signatures find sites in versions of the game which we don't know yet.
+// Bytes with a zero mask are wildcards.
+#define SIGNATURE_MAX_SIZE 64
+
+typedef enum {
+  SIGNATURE_SITE,     // The site is `offset` bytes into the match
+  SIGNATURE_ABSOLUTE  // The match contains the address of the site at `offset`
+} SignatureType;
+
+typedef struct {
+  Site site;
+  SignatureType type;
+  unsigned int offset;
+  unsigned int size;
+  unsigned int anchor;
+  uint8_t bytes[SIGNATURE_MAX_SIZE];
+  uint8_t mask[SIGNATURE_MAX_SIZE];
+} Signature;
+
+// All signatures are searched for in a single pass
+typedef struct {
+  const Signature* signatures;
+  unsigned int count;
+  uint64_t anchors[256];
+  unsigned int match_counts[64];
+  uint32_t results[64];
+} Scanner;
+
+// Picks the byte which is used to find candidates, rare bytes work best
+static bool set_signature_anchor(Signature* signature) {
+  bool found = false;
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if (signature->mask[i] != 0xFF) {
+      continue;
+    }
+    if (!found) {
+      signature->anchor = i;
+      found = true;
+    }
+    uint8_t byte = signature->bytes[i];
+    if ((byte != 0x00) && (byte != 0xFF) && (byte != 0x90) && (byte != 0xCC)) {
+      signature->anchor = i;
+      break;
+    }
+  }
+  return found;
+}
+
+static void init_scanner(Scanner* scanner, const Signature* signatures, unsigned int count) {
+  assert(count <= 64);
+  memset(scanner, 0x00, sizeof(Scanner));
+  scanner->signatures = signatures;
+  scanner->count = count;
+  for(unsigned int i = 0; i < count; i++) {
+    const Signature* signature = &signatures[i];
+    scanner->anchors[signature->bytes[signature->anchor]] |= 1ULL << i;
+  }
+  return;
+}
+
+static bool match_signature(const Signature* signature, const uint8_t* data) {
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if ((data[i] ^ signature->bytes[i]) & signature->mask[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verifies all signatures which have their anchor byte at `position`
+static void check_candidates(Scanner* scanner, const uint8_t* data, size_t size, uint32_t address, size_t position) {
+  uint64_t candidates = scanner->anchors[data[position]];
+  while(candidates != 0) {
+    unsigned int i = __builtin_ctzll(candidates);
+    candidates &= candidates - 1;
+
+    const Signature* signature = &scanner->signatures[i];
+    if (position < signature->anchor) {
+      continue;
+    }
+    size_t start = position - signature->anchor;
+    if ((start + signature->size) > size) {
+      continue;
+    }
+    if (!match_signature(signature, &data[start])) {
+      continue;
+    }
+
+    if (signature->type == SIGNATURE_ABSOLUTE) {
+      memcpy(&scanner->results[i], &data[start + signature->offset], 4);
+    } else {
+      scanner->results[i] = address + start + signature->offset;
+    }
+    scanner->match_counts[i]++;
+  }
+  return;
+}
+
+#if defined(__AVX2__) || defined(AVX2_DISPATCH)
+
+// Finds all anchor bytes in 32 bytes at once, then verifies each candidate.
+// Returns how many bytes were scanned, the rest is left to the caller.
+#if defined(AVX2_DISPATCH)
+__attribute__((target("avx2")))
+#endif
+static size_t scan_memory_avx2(Scanner* scanner, const uint8_t* data, size_t size, uint32_t address) {
+  __m256i needles[64];
+  unsigned int needle_count = 0;
+  for(unsigned int byte = 0; byte < 256; byte++) {
+    if (scanner->anchors[byte] != 0) {
+      needles[needle_count++] = _mm256_set1_epi8(byte);
+    }
+  }
+  size_t i;
+  for(i = 0; (i + 32) <= size; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)&data[i]);
+    uint32_t hits = 0;
+    for(unsigned int k = 0; k < needle_count; k++) {
+      hits |= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needles[k]));
+    }
+    while(hits != 0) {
+      check_candidates(scanner, data, size, address, i + __builtin_ctz(hits));
+      hits &= hits - 1;
+    }
+  }
+  return i;
+}
+
+#endif
+
+// Whether scan_memory uses AVX2 on this machine
+static bool scan_uses_avx2(void) {
+#if defined(__AVX2__)
+  return true;
+#elif defined(AVX2_DISPATCH)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+// Scans `size` bytes of memory, which the game sees at `address`
+static void scan_memory(Scanner* scanner, const uint8_t* data, size_t size, uint32_t address) {
+  size_t i = 0;
+
+#if defined(__AVX2__) || defined(AVX2_DISPATCH)
+  if (scan_uses_avx2()) {
+    i = scan_memory_avx2(scanner, data, size, address);
+  }
+#endif
+
+  for(; i < size; i++) {
+    if (scanner->anchors[data[i]] != 0) {
+      check_candidates(scanner, data, size, address, i);
+    }
+  }
+  return;
+}
+
+static Site find_site(const char* name) {
+  for(int i = 0; i < SITE_COUNT; i++) {
+    if (!strcmp(site_names[i], name)) {
+      return i;
+    }
+  }
+  return SITE_COUNT;
+}
+
+// Parses lines of "<site> <site|absolute> <offset> <bytes>", with "??" as wildcard
+static unsigned int load_signatures(const char* path, Signature* signatures, unsigned int capacity) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+
+  unsigned int count = 0;
+  char line[512];
+  while(fgets(line, sizeof(line), f) != NULL) {
+    char name[64];
+    char type[16];
+    unsigned int offset;
+    int length;
+    if ((line[0] == '#') || (sscanf(line, "%63s %15s %u%n", name, type, &offset, &length) != 3)) {
+      continue;
+    }
+    if (count == capacity) {
+      printf("Ignoring signatures after the first %u\n", capacity);
+      break;
+    }
+    Signature* signature = &signatures[count];
+    memset(signature, 0x00, sizeof(Signature));
+    signature->site = find_site(name);
+    signature->type = !strcmp(type, "absolute") ? SIGNATURE_ABSOLUTE : SIGNATURE_SITE;
+    signature->offset = offset;
+    if (signature->site == SITE_COUNT) {
+      printf("Ignoring signature for unknown site '%s'\n", name);
+      continue;
+    }
+
+    const char* cursor = &line[length];
+    char byte[3];
+    int byte_length;
+    bool too_long = false;
+    while(sscanf(cursor, "%2s%n", byte, &byte_length) == 1) {
+      if (signature->size == SIGNATURE_MAX_SIZE) {
+        too_long = true;
+        break;
+      }
+      if (strcmp(byte, "??")) {
+        signature->bytes[signature->size] = strtoul(byte, NULL, 16);
+        signature->mask[signature->size] = 0xFF;
+      }
+      signature->size++;
+      cursor += byte_length;
+    }
+
+    if (!too_long && set_signature_anchor(signature) && ((signature->offset + ((signature->type == SIGNATURE_ABSOLUTE) ? 4 : 0)) <= signature->size)) {
+      count++;
+    } else {
+      printf("Ignoring invalid signature for '%s'\n", name);
+    }
+  }
+  fclose(f);
+  return count;
+}
+
+static void save_signature(FILE* f, const Signature* signature) {
+  fprintf(f, "%s %s %u", site_names[signature->site], (signature->type == SIGNATURE_ABSOLUTE) ? "absolute" : "site", signature->offset);
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if (signature->mask[i] == 0xFF) {
+      fprintf(f, " %02X", signature->bytes[i]);
+    } else {
+      fprintf(f, " ??");
+    }
+  }
+  fprintf(f, "\n");
+  return;
+}
+
+// Read-only view of a whole file
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} MappedFile;
+
+static bool map_file(MappedFile* mapped, const char* path) {
+  memset(mapped, 0x00, sizeof(MappedFile));
+#ifdef _WIN32
+  mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (mapped->file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  mapped->size = GetFileSize(mapped->file, NULL);
+  mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapped->mapping == NULL) {
+    CloseHandle(mapped->file);
+    return false;
+  }
+  mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (mapped->data == NULL) {
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+    return false;
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) == -1) || (st.st_size == 0)) {
+    close(fd);
+    return false;
+  }
+  mapped->size = st.st_size;
+  int flags = MAP_PRIVATE;
+#if defined(IN_PROCESS) && defined(MAP_32BIT)
+  // The game can only refer to the data with 32 bit pointers
+  flags |= MAP_32BIT;
+#endif
+  void* data = mmap(NULL, mapped->size, PROT_READ, flags, fd, 0);
+
+  // The mapping keeps the file alive
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  mapped->data = data;
+#endif
+  return true;
+}
+
+static void unmap_file(MappedFile* mapped) {
+#ifdef _WIN32
+  UnmapViewOfFile(mapped->data);
+  CloseHandle(mapped->mapping);
+  CloseHandle(mapped->file);
+#else
+  munmap((void*)mapped->data, mapped->size);
+#endif
+  return;
+}
+
+// The font textures are converted at build time and stored in a single pack.
+// All integers are little endian, payloads are 16 byte aligned.
+#define TEXTURE_PACK_MAGIC "SWTP"
+#define TEXTURE_PACK_VERSION 1
+
+typedef enum {
+  TEXTURE_FORMAT_GRAY4 = 1
+} TextureFormat;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t reserved;
+  uint64_t entries_checksum;
+} TexturePackHeader;
+
+typedef struct {
+  char font[8];
+  uint32_t page;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint32_t offset;
+  uint32_t size;
+  uint64_t checksum;
+} TexturePackEntry;
+
+typedef struct {
+  MappedFile file;
+  const TexturePackHeader* header;
+  const TexturePackEntry* entries;
+
+  // Packs which are shared by many targets are only verified once
+  bool verified;
+} TexturePack;
+
+static bool open_texture_pack(TexturePack* pack, const char* path) {
+  pack->verified = false;
+  if (!map_file(&pack->file, path)) {
+    printf("Unable to open '%s'\n", path);
+    return false;
+  }
+
+  const uint8_t* data = pack->file.data;
+  size_t size = pack->file.size;
+  pack->header = (const TexturePackHeader*)data;
+  pack->entries = (const TexturePackEntry*)&data[sizeof(TexturePackHeader)];
+
+  // Validate the header and the table before anything else looks at it
+  const TexturePackHeader* header = pack->header;
+  size_t entries_size = (size_t)header->entry_count * sizeof(TexturePackEntry);
+  bool valid = (size >= sizeof(TexturePackHeader)) &&
+               !memcmp(header->magic, TEXTURE_PACK_MAGIC, 4) &&
+               (header->version == TEXTURE_PACK_VERSION) &&
+               ((size - sizeof(TexturePackHeader)) / sizeof(TexturePackEntry) >= header->entry_count) &&
+               (hash64(pack->entries, entries_size, 0) == header->entries_checksum);
+  for(uint32_t i = 0; valid && (i < header->entry_count); i++) {
+    const TexturePackEntry* entry = &pack->entries[i];
+    valid = (entry->format == TEXTURE_FORMAT_GRAY4) &&
+            (entry->size == (entry->width * entry->height / 2)) &&
+            (entry->offset <= size) && (entry->size <= (size - entry->offset));
+  }
+  if (!valid) {
+    printf("Texture pack '%s' is invalid\n", path);
+    unmap_file(&pack->file);
+    return false;
+  }
+
+  printf("Opened '%s' with %u textures\n", path, header->entry_count);
+  return true;
+}
+
+static void close_texture_pack(TexturePack* pack) {
+  unmap_file(&pack->file);
+  return;
+}
+
+static const TexturePackEntry* find_texture(const TexturePack* pack, const char* font, unsigned int page) {
+  for(uint32_t i = 0; i < pack->header->entry_count; i++) {
+    const TexturePackEntry* entry = &pack->entries[i];
+    if (!strncmp(entry->font, font, sizeof(entry->font)) && (entry->page == page)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+#ifdef TEXTURE_PACK
+
+// Converts 8 bit gray + alpha pixels to 4 bit gray, 2 pixels per byte.
+// This is the reference implementation for the vectorized versions.
+static void pack_texture_reference(uint8_t* out, const uint8_t* in, size_t pixel_count) {
+  memset(out, 0x00, pixel_count / 2);
+  for(size_t i = 0; i < pixel_count; i++) {
+    out[i / 2] |= (in[i * 2 + 0] & 0xF0) >> ((i % 2) * 4);
+  }
+  return;
+}
+
+#if defined(__SSE2__)
+
+// Packs 32 pixels per step
+static size_t pack_texture_sse2(uint8_t* out, const uint8_t* in, size_t pixel_count) {
+  const __m128i gray_mask = _mm_set1_epi16(0x00FF);
+  const __m128i high_mask = _mm_set1_epi16(0x00F0);
+  size_t i;
+  for(i = 0; (i + 32) <= pixel_count; i += 32) {
+    const __m128i* source = (const __m128i*)&in[i * 2];
+
+    // Drop the alpha channel, so we have 16 gray values in each vector
+    __m128i a = _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128(&source[0]), gray_mask),
+                                 _mm_and_si128(_mm_loadu_si128(&source[1]), gray_mask));
+    __m128i b = _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128(&source[2]), gray_mask),
+                                 _mm_and_si128(_mm_loadu_si128(&source[3]), gray_mask));
+
+    // Merge the upper nibbles of each pair of pixels
+    a = _mm_or_si128(_mm_and_si128(a, high_mask), _mm_srli_epi16(a, 12));
+    b = _mm_or_si128(_mm_and_si128(b, high_mask), _mm_srli_epi16(b, 12));
+
+    _mm_storeu_si128((__m128i*)&out[i / 2], _mm_packus_epi16(a, b));
+  }
+  return i;
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+// Packs 64 pixels per step
+static size_t pack_texture_avx2(uint8_t* out, const uint8_t* in, size_t pixel_count) {
+  const __m256i gray_mask = _mm256_set1_epi16(0x00FF);
+  const __m256i high_mask = _mm256_set1_epi16(0x00F0);
+
+  // The packs work on each 128 bit lane, so the result has to be reordered
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  size_t i;
+  for(i = 0; (i + 64) <= pixel_count; i += 64) {
+    const __m256i* source = (const __m256i*)&in[i * 2];
+
+    __m256i a = _mm256_packus_epi16(_mm256_and_si256(_mm256_loadu_si256(&source[0]), gray_mask),
+                                    _mm256_and_si256(_mm256_loadu_si256(&source[1]), gray_mask));
+    __m256i b = _mm256_packus_epi16(_mm256_and_si256(_mm256_loadu_si256(&source[2]), gray_mask),
+                                    _mm256_and_si256(_mm256_loadu_si256(&source[3]), gray_mask));
+
+    a = _mm256_or_si256(_mm256_and_si256(a, high_mask), _mm256_srli_epi16(a, 12));
+    b = _mm256_or_si256(_mm256_and_si256(b, high_mask), _mm256_srli_epi16(b, 12));
+
+    __m256i packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), order);
+    _mm256_storeu_si256((__m256i*)&out[i / 2], packed);
+  }
+  return i;
+}
+
+#endif
+
+static void pack_texture(uint8_t* out, const uint8_t* in, size_t pixel_count) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  i = pack_texture_avx2(out, in, pixel_count);
+#elif defined(__SSE2__)
+  i = pack_texture_sse2(out, in, pixel_count);
+#endif
+
+  // Handle the remaining pixels
+  pack_texture_reference(&out[i / 2], &in[i * 2], pixel_count - i);
+  return;
+}
+
+// Loads a GIMP gray + alpha export and converts it to the game format
+static void load_texture(uint8_t* out, const char* path, size_t pixel_count) {
+  size_t size = pixel_count * 2;
+  uint8_t* in = malloc(size);
+  assert(in != NULL);
+
+  FILE* f = fopen(path, "rb");
+  assert(f != NULL);
+  size_t read_count = fread(in, size, 1, f);
+  assert(read_count == 1);
+  fclose(f);
+
+  pack_texture(out, in, pixel_count);
+
+  free(in);
+  return;
+}
+
+// Compares one packer with the reference, the remaining pixels are done by the reference like in pack_texture
+static bool verify_packer(const char* name, size_t (*packer)(uint8_t* out, const uint8_t* in, size_t pixel_count), const uint8_t* in, size_t pixel_count, const uint8_t* reference, const char* input) {
+  size_t size = pixel_count / 2;
+  uint8_t* out = malloc(size + 1);
+  assert(out != NULL);
+  size_t i = 0;
+  if (packer != NULL) {
+    i = packer(out, in, pixel_count);
+    pack_texture_reference(&out[i / 2], &in[i * 2], pixel_count - i);
+  } else {
+    pack_texture(out, in, pixel_count);
+  }
+  bool equal = !memcmp(out, reference, size);
+  if (!equal) {
+    size_t offset = 0;
+    while(out[offset] == reference[offset]) {
+      offset++;
+    }
+    printf("%s differs from the reference for %s (%zu pixels) at byte %zu: 0x%02X instead of 0x%02X\n", name, input, pixel_count, offset, out[offset], reference[offset]);
+  }
+  free(out);
+  return equal;
+}
+
+// Verifies all packers which were compiled in against the reference.
+// Random input of various sizes is used, so the ends of each vector loop are covered, followed by the given files.
+static bool verify_packers(int input_count, char* inputs[]) {
+  uint32_t state = 0x12345678;
+  size_t pixel_counts[] = { 0, 2, 30, 32, 34, 62, 64, 66, 126, 128, 130, 1000, 4096, 512 * 1024 };
+  int count = sizeof(pixel_counts) / sizeof(pixel_counts[0]) + input_count;
+  bool equal = true;
+  for(int j = 0; j < count; j++) {
+    size_t pixel_count;
+    uint8_t* in;
+    char input[1024];
+    if (j < (int)(sizeof(pixel_counts) / sizeof(pixel_counts[0]))) {
+      pixel_count = pixel_counts[j];
+      in = malloc(pixel_count * 2 + 1);
+      assert(in != NULL);
+      for(size_t i = 0; i < (pixel_count * 2); i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        in[i] = state >> 24;
+      }
+      snprintf(input, sizeof(input), "random data");
+    } else {
+      const char* path = inputs[j - sizeof(pixel_counts) / sizeof(pixel_counts[0])];
+      MappedFile file;
+      if (!map_file(&file, path)) {
+        printf("Unable to open '%s'\n", path);
+        return false;
+      }
+      pixel_count = file.size / 2;
+      in = malloc(file.size + 1);
+      assert(in != NULL);
+      memcpy(in, file.data, file.size);
+      unmap_file(&file);
+      snprintf(input, sizeof(input), "'%s'", path);
+    }
+
+    uint8_t* reference = malloc(pixel_count / 2 + 1);
+    assert(reference != NULL);
+    pack_texture_reference(reference, in, pixel_count);
+#if defined(__SSE2__)
+    equal &= verify_packer("SSE2", pack_texture_sse2, in, pixel_count, reference, input);
+#endif
+#if defined(__AVX2__)
+    equal &= verify_packer("AVX2", pack_texture_avx2, in, pixel_count, reference, input);
+#endif
+    equal &= verify_packer("pack_texture", NULL, in, pixel_count, reference, input);
+    free(reference);
+    free(in);
+  }
+
+  printf("Verified the %s packers with %d inputs: %s\n",
+#if defined(__AVX2__)
+         "SSE2, AVX2 and default",
+#elif defined(__SSE2__)
+         "SSE2 and default",
+#else
+         "default",
+#endif
+         count, equal ? "identical" : "DIFFERENT");
+  return equal;
+}
+
+#endif
+
+// Textures are verified in parallel, after all of them have been placed
+typedef struct {
+  const char* patch;
+  uint32_t address;
+  const TexturePackEntry* entry;
+  const uint8_t* data;
+} TextureJob;
+
+typedef struct {
+  const TexturePack* pack;
+  TextureJob* jobs;
+  size_t count;
+  size_t capacity;
+  size_t next;
+  pthread_mutex_t mutex;
+  size_t shared_count;
+  size_t shared_size;
+} TextureJobs;
+
+// Number of threads used for texture verification
+unsigned int thread_count = 0;
+
+static unsigned int default_thread_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count > 0) ? count : 1;
+#endif
+}
+
+static void init_texture_jobs(TextureJobs* textures, const TexturePack* pack) {
+  memset(textures, 0x00, sizeof(TextureJobs));
+  textures->pack = pack;
+  pthread_mutex_init(&textures->mutex, NULL);
+  return;
+}
+
+static void free_texture_jobs(TextureJobs* textures) {
+  free(textures->jobs);
+  pthread_mutex_destroy(&textures->mutex);
+  return;
+}
+
+static void add_texture_job(TextureJobs* textures, const char* patch, const TexturePackEntry* entry, uint32_t address) {
+  if (textures->count == textures->capacity) {
+    textures->capacity = textures->capacity ? textures->capacity * 2 : 16;
+    textures->jobs = realloc(textures->jobs, textures->capacity * sizeof(TextureJob));
+    assert(textures->jobs != NULL);
+  }
+  TextureJob* job = &textures->jobs[textures->count++];
+  job->patch = patch;
+  job->address = address;
+  job->entry = entry;
+  job->data = &textures->pack->file.data[entry->offset];
+  return;
+}
+
+// Returns the address of an identical texture which was already placed, or 0
+static uint32_t find_shared_texture(TextureJobs* textures, const TexturePackEntry* entry) {
+  const uint8_t* data = &textures->pack->file.data[entry->offset];
+  for(size_t i = 0; i < textures->count; i++) {
+    TextureJob* job = &textures->jobs[i];
+    if ((job->entry->checksum == entry->checksum) && (job->entry->size == entry->size) &&
+        ((job->data == data) || !memcmp(job->data, data, entry->size))) {
+      textures->shared_count++;
+      textures->shared_size += entry->size;
+      return job->address;
+    }
+  }
+  return 0;
+}
+
+static void* texture_worker(void* user) {
+  TextureJobs* textures = user;
+  while(true) {
+    pthread_mutex_lock(&textures->mutex);
+    size_t i = textures->next++;
+    pthread_mutex_unlock(&textures->mutex);
+    if (i >= textures->count) {
+      break;
+    }
+
+    // Make sure the pack wasn't damaged after it was built
+    TextureJob* job = &textures->jobs[i];
+    uint64_t checksum = hash64(job->data, job->entry->size, 0);
+    assert(checksum == job->entry->checksum);
+  }
+  return NULL;
+}
+
+// Runs the texture jobs, returns the number of threads which were used
+static unsigned int run_texture_jobs(TextureJobs* textures) {
+
+  unsigned int worker_count = (thread_count != 0) ? thread_count : default_thread_count();
+  if (worker_count > textures->count) {
+    worker_count = textures->count;
+  }
+
+  // The calling thread is also a worker
+  pthread_t threads[64];
+  unsigned int started = 0;
+  for(unsigned int i = 1; (i < worker_count) && (started < (sizeof(threads) / sizeof(threads[0]))); i++) {
+    if (pthread_create(&threads[started], NULL, texture_worker, textures) == 0) {
+      started++;
+    }
+  }
+  texture_worker(textures);
+  for(unsigned int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return started + 1;
+}
+
+static void verify_texture_pack(TexturePack* pack) {
+  TextureJobs textures;
+  init_texture_jobs(&textures, pack);
+  for(uint32_t i = 0; i < pack->header->entry_count; i++) {
+    add_texture_job(&textures, NULL, &pack->entries[i], 0);
+  }
+  unsigned int used_threads = run_texture_jobs(&textures);
+  printf("Verified %zu textures with %u threads\n", textures.count, used_threads);
+  free_texture_jobs(&textures);
+  pack->verified = true;
+  return;
+}
+
+// Verifies all textures, then writes them to the locations they were given
+static void load_textures(Target target, TextureJobs* textures) {
+  trace_stage("verify_textures");
+  if (!textures->pack->verified) {
+    unsigned int used_threads = run_texture_jobs(textures);
+    printf("Verified %zu textures with %u threads\n", textures->count, used_threads);
+  }
+  printf("Shared %zu textures, saved %zu bytes\n", textures->shared_count, textures->shared_size);
+
+#ifndef IN_PROCESS
+  for(size_t i = 0; i < textures->count; i++) {
+    TextureJob* job = &textures->jobs[i];
+    begin_patch(target, job->patch);
+    write_data(target, job->address, job->data, job->entry->size);
+  }
+#endif
+  return;
+}
+
+static void patchTextureTable(Target target, TextureJobs* textures, uint32_t offset, uint32_t code_begin_offset, uint32_t code_end_offset, uint32_t width, uint32_t height, const char* filename) {
+  begin_patch(target, filename);
+
+  // Create a code cave
+  // The original argument for the width is only 8 bit (signed), so it's hard
+  // to extend. That's why we use a code cave.
+  Emitter e;
+  init_emitter(&e);
+
+  // Patches the arguments for the texture loader
+  push_u32(&e, height);
+  push_u32(&e, width);
+  push_u32(&e, height);
+  push_u32(&e, width);
+  jmp(&e, code_end_offset);
+
+  uint32_t cave_memory_offset = commit(target, &e);
+
+  //FIXME: Fixup the format?
+  //.text:0042D794                 push    0
+  //.text:0042D796                 push    3
+
+  // Write code to jump into the codecave and clear original code
+  Emitter hook;
+  init_emitter(&hook);
+  jmp(&hook, cave_memory_offset);
+  patch_log(target.plan, "Tying to jump to 0x%08X\n", cave_memory_offset);
+  commit_hook(target, &hook, code_begin_offset, code_end_offset - code_begin_offset);
+
+  // Get number of textures in the table
+  uint32_t count = read32(target, offset + 0);
+
+  // Loop over all textures
+  for(unsigned int i = 0; i < count; i++) {
+
+    // Reserve space for the pixel data, it will be loaded later
+    const TexturePackEntry* entry = find_texture(textures->pack, filename, i);
+    assert(entry != NULL);
+    assert((entry->width == width) && (entry->height == height));
+    patch_log(target.plan, "Loading '%s' page %d\n", filename, i);
+
+    // Pages with the same content are only placed once
+    uint32_t texture_new = find_shared_texture(textures, entry);
+    if (texture_new == 0) {
+#ifdef IN_PROCESS
+      // The game uses the page from the mapped pack, nothing is copied
+      uintptr_t mapped = (uintptr_t)&textures->pack->file.data[entry->offset];
+      assert(mapped == (uint32_t)mapped);
+      texture_new = mapped;
+#else
+      texture_new = allocate(target, ARENA_TEXTURES, entry->size);
+#endif
+      add_texture_job(textures, filename, entry, texture_new);
+    }
+
+    // Patch the table entry
+    uint32_t texture_old = read32(target, offset + 4 + i * 4);
+    write_pointer32(target, offset + 4 + i * 4, texture_new);
+    patch_log(target.plan, "%d: 0x%X -> 0x%X\n", i, texture_old, texture_new);
+  }
+
+  return;
+}
+
+static void modify_network_guid(Target target, const void* data, size_t size) {
+
+  // Patches the game GUID so people don't cheat with it (as easily)
+
+  if (size == 0) {
+    size = strlen(data);
+  }
+
+  #define SWAP(a, b) if (a ^ b) {a ^= b; b ^= a; a ^= b;}
+
+  uint8_t* s = target.plan->guid_state;
+  if (!target.plan->guid_initialized) {
+
+    // Initialize the RC4 S-Box
+    for (int i = 0; i < 256; i++) {
+      s[i] = i;
+    }
+
+    target.plan->guid_initialized = true;
+  }
+
+  // Modify the hash using RC4 schedule
+  assert(size <= 256);
+  const uint8_t* data_bytes = data;
+  uint8_t j = 0;
+  for (int i = 0; i < 256; i++) {
+    j += s[i] + data_bytes[i % size];
+    SWAP(s[i], s[j]);
+  }
+
+  // Several patches change the GUID, so its bytes have an owner of their own
+  const char* patch = target.plan->patch;
+  begin_patch(target, "network_guid");
+
+  // Emit 16 bytes of the keystream
+  uint8_t k_i = 0;
+  uint8_t k_j = 0;
+  uint8_t k_s[256];
+  memcpy(k_s, s, 256);
+  for(int i = 0; i < 16; i++) {
+    k_j += k_s[++k_i];
+    SWAP(k_s[k_i], k_s[k_j]);
+    uint8_t rc4_output = k_s[(k_s[k_i] + k_s[k_j]) & 0xFF];
+    write8(target, site(target, SITE_GUID) + i, rc4_output);
+  }
+
+  // Overwrite the first 2 byte with a version index, so we have room
+  // to fix the algorithm if we have messed up
+  write16(target, site(target, SITE_GUID) + 0, 0x00000000);
+
+  begin_patch(target, patch);
+  return;
+}
+
+static void patch_network_upgrades(Target target, const uint8_t* upgrade_levels, const uint8_t* upgrade_healths) {
+  // Upgrade network play updates to 100%
+  begin_patch(target, "network_upgrades");
+
+  modify_network_guid(target, "Upgrades", 0);
+  modify_network_guid(target, upgrade_levels, 7);
+  modify_network_guid(target, upgrade_healths, 7);
+
+  // The following patch only supports the same upgrade level and health for menus
+  // So in order to keep everything synchronized, we assert that only one setting is present for all categories
+  for(int i = 0; i < 7; i++) {
+    assert(upgrade_levels[i] == upgrade_levels[0]);
+    assert(upgrade_healths[i] == upgrade_healths[0]);
+  }
+
+  // Now do the actual upgrade for menus
+  write_code8(target, site(target, SITE_UPGRADE_MENU_LEVEL), upgrade_levels[0]);
+  write_code8(target, site(target, SITE_UPGRADE_MENU_HEALTH), upgrade_healths[0]);
+
+  //FIXME: Upgrade network player creation
+
+  // 0x45B725 vs 0x45B9FF
+
+  #if 0
+  lea     edx, [esp+1Ch+upgrade_health]
+  lea     eax, [esp+1Ch+upgrade_level]
+  push    edx             ; upgrade_healths
+  push    eax             ; upgrade_levels
+  push    ebp             ; handling_in
+  push    offset handling_out ; handling_out
+  mov     [esp+esi+2Ch+upgrade_health], cl
+  call    _sub_449D00_generate_upgraded_handling_table_data
+  #endif
+
+  // Place upgrade data in memory
+
+  uint32_t memory_offset_upgrade_levels = allocate(target, ARENA_RODATA, 7);
+  write_data(target, memory_offset_upgrade_levels, upgrade_levels, 7);
+
+  uint32_t memory_offset_upgrade_healths = allocate(target, ARENA_RODATA, 7);
+  write_data(target, memory_offset_upgrade_healths, upgrade_healths, 7);
+
+
+  // Now inject the code
+
+  Emitter e;
+  init_emitter(&e);
+  push_edx(&e);
+  push_eax(&e);
+  push_u32(&e, memory_offset_upgrade_healths); // (upgrade_healths)
+  push_u32(&e, memory_offset_upgrade_levels); // (upgrade_levels)
+  push_esi(&e);
+  push_edi(&e);
+  call(&e, site(target, SITE_GENERATE_UPGRADED_HANDLING)); // _sub_449D00
+  add_esp(&e, 0x10);
+  pop_eax(&e);
+  pop_edx(&e);
+  retn(&e);
+  uint32_t memory_offset_upgrade_code = commit(target, &e);
+
+
+  // Install it by jumping from 0x45B765 and returning to 0x45B76C
+
+  Emitter hook;
+  init_emitter(&hook);
+  call(&hook, memory_offset_upgrade_code);
+  commit_hook(target, &hook, site(target, SITE_UPGRADE_HOOK), 7);
+
+  return;
+}
+
+static void patch_network_collisions(Target target) {
+  // Disable collision between network players
+  begin_patch(target, "network_collisions");
+
+  modify_network_guid(target, "Collisions", 0);
+
+  // Inject the code
+
+  Emitter e;
+  init_emitter(&e);
+
+  push_edx(&e);
+
+  // -> mov     edx, _dword_4D5E00_is_multiplayer
+  emit_u32(&e, (const uint8_t[]){ 0x8B, 0x15 }, 2, site(target, SITE_IS_MULTIPLAYER));
+
+  test_edx_edx(&e);
+  pop_edx(&e);
+
+  // -> jz _sub_47B0C0
+  jz(&e, site(target, SITE_COLLIDE));
+
+  retn(&e);
+
+  uint32_t memory_offset_collision_code = commit(target, &e);
+
+
+  // Install it by patching call at 0x47B5AF
+
+  Emitter hook;
+  init_emitter(&hook);
+  call(&hook, memory_offset_collision_code);
+  commit_hook(target, &hook, site(target, SITE_COLLISION_HOOK), 5);
+
+  return;
+}
+
+static void patch_audio_stream_quality(Target target, uint32_t samplerate, uint8_t bits_per_sample, bool stereo) {
+  // Patch audio streaming quality
+  begin_patch(target, "audio_stream_quality");
+
+  // Calculate a fitting buffer-size
+  uint32_t buffer_size = 2 * samplerate * (bits_per_sample / 8) * (stereo ? 2 : 1);
+
+  // Patch audio stream source setting
+  write_code32(target, site(target, SITE_AUDIO_BUFFER_SIZE), buffer_size);
+  write_code8(target, site(target, SITE_AUDIO_BITS_PER_SAMPLE), bits_per_sample);
+  write_code32(target, site(target, SITE_AUDIO_SAMPLERATE), samplerate);
+
+  // Patch audio stream buffer chunk size
+  write_code32(target, site(target, SITE_AUDIO_CHUNK_SIZE_0), buffer_size / 2);
+  write_code32(target, site(target, SITE_AUDIO_CHUNK_SIZE_1), buffer_size / 2);
+  write_code32(target, site(target, SITE_AUDIO_CHUNK_SIZE_2), buffer_size / 2);
+
+  return;
+}
+
+static void patch_sprite_loader_to_load_tga(Target target) {
+  // Replace the sprite loader with a version that checks for "data\\images\\sprite-%d.tga"
+  begin_patch(target, "sprite_loader_to_load_tga");
+
+  // Write the path we want to use to the binary
+  const char* tga_path = "data\\sprites\\sprite-%d.tga";
+
+  uint32_t memory_offset_tga_path = allocate(target, ARENA_RODATA, strlen(tga_path) + 1);
+  write_data(target, memory_offset_tga_path, tga_path, strlen(tga_path) + 1);
+
+
+  Emitter e;
+  init_emitter(&e);
+  int load_success = new_label(&e);
+  int finish = new_label(&e);
+
+  // Start of actual code
+  // Read the sprite_index from stack
+  //  -> mov     eax, [esp+4]
+  EMIT(&e, 0x8B, 0x44, 0x24, 0x04);
+
+  // Make room for sprintf buffer and keep the pointer in edx
+  add_esp(&e, -0x400);
+  //  -> mov     edx, esp
+  EMIT(&e, 0x89, 0xE2);
+
+  // Generate the path, keep sprite_index on stack as we'll keep using it
+  push_eax(&e); // (sprite_index)
+  push_u32(&e, memory_offset_tga_path); // (fmt)
+  push_edx(&e); // (buffer)
+  call(&e, site(target, SITE_SPRINTF)); // sprintf
+  pop_edx(&e); // (buffer)
+  add_esp(&e, 0x4);
+
+  // Attempt to load the TGA, then remove path from stack
+  push_edx(&e); // (buffer)
+  call(&e, site(target, SITE_LOAD_SPRITE_FROM_TGA)); // load_sprite_from_tga_and_add_loaded_sprite
+  add_esp(&e, 0x4);
+
+  // Check if the load failed
+  test_eax_eax(&e);
+  jnz_label(&e, load_success);
+
+  // Load failed, so load the original sprite (sprite-index still on stack)
+  call(&e, site(target, SITE_LOAD_SPRITE_INTERNAL)); // load_sprite_internal
+  jmp_label(&e, finish);
+
+
+  // FIXME: load_success: Yay! Shift down size, to compensate for higher resolution
+  bind_label(&e, load_success);
+  #if 1
+
+  // Shift the width and height of the sprite to the right
+  #if 1
+  EMIT(&e, 0x66, 0xC1, 0x68, 0, 1);
+  EMIT(&e, 0x66, 0xC1, 0x68, 2, 2);
+  EMIT(&e, 0x66, 0xC1, 0x68, 14, 2);
+  #endif
+
+  // Get address of page and repeat steps
+  EMIT(&e, 0x8B, 0x50, 16);
+
+  #if 1
+  EMIT(&e, 0x66, 0xC1, 0x6A, 0, 1);
+  EMIT(&e, 0x66, 0xC1, 0x6A, 2, 2);
+  #endif
+
+  // Get address of texture and repeat steps
+
+  //0:  8b 50 10                mov    edx,DWORD PTR [eax+0x10]
+  //3:  66 c1 6a 02 02          shr    WORD PTR [edx+0x2],0x2
+  #endif
+
+  // finish: Clear stack and return
+  bind_label(&e, finish);
+  add_esp(&e, 0x4 + 0x400);
+  retn(&e);
+
+  uint32_t memory_offset_tga_loader_code = commit(target, &e);
+
+
+  // Install it by jumping from 0x446FB0 (and we'll return directly)
+  Emitter hook;
+  init_emitter(&hook);
+  jmp(&hook, memory_offset_tga_loader_code);
+  commit_hook(target, &hook, site(target, SITE_SPRITE_LOADER_HOOK), 5);
+
+  return;
+}
+
+static void patch_trigger_display(Target target) {
+  // Display triggers
+  begin_patch(target, "trigger_display");
+
+  const char* trigger_string = "Trigger %d activated";
+  float trigger_string_display_duration = 3.0f;
+
+  uint32_t memory_offset_trigger_string = allocate(target, ARENA_RODATA, strlen(trigger_string) + 1);
+  write_data(target, memory_offset_trigger_string, trigger_string, strlen(trigger_string) + 1);
+
+  Emitter e;
+  init_emitter(&e);
+
+  // Read the trigger from stack
+  //  -> mov     eax, [esp+4]
+  EMIT(&e, 0x8B, 0x44, 0x24, 0x04);
+
+  // Get pointer to section 8
+  //0:  8b 40 4c                mov    eax,DWORD PTR [eax+0x4c]
+  EMIT(&e, 0x8B, 0x40, 0x4C);
+
+  // Read the section8.trigger_action field
+  //3:  0f b7 40 24             movzx  eax,WORD PTR [eax+0x24] 
+  EMIT(&e, 0x0F, 0xB7, 0x40, 0x24);
+
+  // Make room for sprintf buffer and keep the pointer in edx
+  add_esp(&e, -0x400);
+  //  -> mov     edx, esp
+  EMIT(&e, 0x89, 0xE2);
+
+  // Generate the string we'll display
+  push_eax(&e); // (trigger index)
+  push_u32(&e, memory_offset_trigger_string); // (fmt)
+  push_edx(&e); // (buffer)
+  call(&e, site(target, SITE_SPRINTF)); // sprintf
+  pop_edx(&e); // (buffer)
+  add_esp(&e, 0x8);
+
+  // Display a message
+  push_u32(&e, *(uint32_t*)&trigger_string_display_duration);
+  push_edx(&e); // (buffer)
+  call(&e, site(target, SITE_SHOW_MESSAGE));
+  add_esp(&e, 0x8);
+
+  // Pop the string buffer off of the stack
+  add_esp(&e, 0x400);
+
+  // Jump to the real function to run the trigger
+  jmp(&e, site(target, SITE_RUN_TRIGGER));
+
+  uint32_t memory_offset_trigger_code = commit(target, &e);
+
+  // Install it by replacing the call destination (we'll jump to the real one)
+  Emitter hook;
+  init_emitter(&hook);
+  call(&hook, memory_offset_trigger_code);
+  commit_hook(target, &hook, site(target, SITE_TRIGGER_HOOK), 5);
+
+  return;
+}
+
+// Everything which changes the result of the patches
+typedef struct {
+  bool fonts;
+  bool network_upgrades;
+  uint8_t upgrade_levels[7];
+  uint8_t upgrade_healths[7];
+  bool network_collisions;
+  bool audio_stream_quality;
+  uint32_t samplerate;
+  uint8_t bits_per_sample;
+  bool stereo;
+  bool sprite_loader_tga;
+  bool trigger_display;
+} Settings;
+
+static void default_settings(Settings* settings) {
+
+  // Cleared, so the settings can also be hashed and compared as bytes
+  memset(settings, 0x00, sizeof(Settings));
+
+  settings->fonts = true;
+
+  settings->network_upgrades = true;
+  memset(settings->upgrade_levels, 5, sizeof(settings->upgrade_levels));
+  memset(settings->upgrade_healths, 0xFF, sizeof(settings->upgrade_healths));
+
+  settings->network_collisions = true;
+
+  settings->audio_stream_quality = false;
+  settings->samplerate = 22050 * 2;
+  settings->bits_per_sample = 16;
+  settings->stereo = true;
+
+  settings->sprite_loader_tga = false;
+
+  settings->trigger_display = false;
+  return;
+}
+
+static void patch(Target target, const Settings* settings, const TexturePack* pack) {
+#if 0
+  // This is a debug feature to dump the original font textures
+
+  dumpTextureTable(target, site(target, SITE_FONT0_TABLE), 3, 0, 64, 128, "font0");
+  dumpTextureTable(target, site(target, SITE_FONT1_TABLE), 3, 0, 64, 128, "font1");
+  dumpTextureTable(target, site(target, SITE_FONT2_TABLE), 3, 0, 64, 128, "font2");
+  dumpTextureTable(target, site(target, SITE_FONT3_TABLE), 3, 0, 64, 128, "font3");
+  dumpTextureTable(target, site(target, SITE_FONT4_TABLE), 3, 0, 64, 128, "font4");
+#endif
+
+
+// Start the actual patching
+
+  if (settings->fonts) {
+    assert(pack != NULL);
+    TextureJobs textures;
+    init_texture_jobs(&textures, pack);
+
+    patchTextureTable(target, &textures, site(target, SITE_FONT0_TABLE), site(target, SITE_FONT0_HOOK), site(target, SITE_FONT0_RETURN), 512, 1024, "font0");
+    patchTextureTable(target, &textures, site(target, SITE_FONT1_TABLE), site(target, SITE_FONT1_HOOK), site(target, SITE_FONT1_RETURN), 512, 1024, "font1");
+    patchTextureTable(target, &textures, site(target, SITE_FONT2_TABLE), site(target, SITE_FONT2_HOOK), site(target, SITE_FONT2_RETURN), 512, 1024, "font2");
+    patchTextureTable(target, &textures, site(target, SITE_FONT3_TABLE), site(target, SITE_FONT3_HOOK), site(target, SITE_FONT3_RETURN), 512, 1024, "font3");
+    patchTextureTable(target, &textures, site(target, SITE_FONT4_TABLE), site(target, SITE_FONT4_HOOK), site(target, SITE_FONT4_RETURN), 512, 1024, "font4");
+
+    // The pages are only placed while measuring, their contents don't change any size
+    if (!target.plan->measuring) {
+      load_textures(target, &textures);
+    }
+    free_texture_jobs(&textures);
+  }
+
+  if (settings->network_upgrades) {
+    patch_network_upgrades(target, settings->upgrade_levels, settings->upgrade_healths);
+  }
+
+  if (settings->network_collisions) {
+    patch_network_collisions(target);
+  }
+
+  if (settings->audio_stream_quality) {
+    patch_audio_stream_quality(target, settings->samplerate, settings->bits_per_sample, settings->stereo);
+  }
+
+  if (settings->sprite_loader_tga) {
+    patch_sprite_loader_to_load_tga(target);
+  }
+
+  if (settings->trigger_display) {
+    patch_trigger_display(target);
+  }
+
+  if (target.plan->measuring) {
+    return;
+  }
+
+  // Dump out the network GUID
+
+  printf("Network GUID is: ");
+  for(int i = 0; i < 16; i++) {
+    printf("%02X", read8(target, site(target, SITE_GUID) + i));
+  }
+  printf("\n"); 
+
+  report_allocator(target.allocator);
+
+  return;
+}
+
+
+#if defined(TEXTURE_PACK)
+
+// Build tool which converts the GIMP exports into a texture pack
+int main(int argc, char* argv[]) {
+
+  // Only checks the vectorized packers, nothing is written
+  if ((argc >= 2) && !strcmp(argv[1], "--verify")) {
+    return verify_packers(argc - 2, &argv[2]) ? 0 : 1;
+  }
+
+  if ((argc < 2) || (((argc - 2) % 5) != 0)) {
+    fprintf(stderr, "Usage: %s <output> [<font> <page> <width> <height> <input>]...\n", argv[0]);
+    fprintf(stderr, "       %s --verify [<input>]...\n", argv[0]);
+    return 1;
+  }
+
+  uint32_t entry_count = (argc - 2) / 5;
+  TexturePackEntry* entries = calloc(entry_count, sizeof(TexturePackEntry));
+  uint8_t** payloads = calloc(entry_count, sizeof(uint8_t*));
+  bool* shared = calloc(entry_count, sizeof(bool));
+  assert((entries != NULL) && (payloads != NULL) && (shared != NULL));
+
+  // The payloads follow the table
+  uint32_t offset = align_up(sizeof(TexturePackHeader) + entry_count * sizeof(TexturePackEntry), 16);
+  uint32_t input_size = 0;
+  for(uint32_t i = 0; i < entry_count; i++) {
+    char** arguments = &argv[2 + i * 5];
+    TexturePackEntry* entry = &entries[i];
+
+    assert(strlen(arguments[0]) <= sizeof(entry->font));
+    strncpy(entry->font, arguments[0], sizeof(entry->font));
+    entry->page = atoi(arguments[1]);
+    entry->width = atoi(arguments[2]);
+    entry->height = atoi(arguments[3]);
+    entry->format = TEXTURE_FORMAT_GRAY4;
+    entry->size = entry->width * entry->height / 2;
+    input_size += entry->width * entry->height * 2;
+
+    payloads[i] = malloc(entry->size);
+    assert(payloads[i] != NULL);
+    load_texture(payloads[i], arguments[4], entry->width * entry->height);
+    entry->checksum = hash64(payloads[i], entry->size, 0);
+
+    // Identical pages are only stored once
+    for(uint32_t j = 0; j < i; j++) {
+      if ((entries[j].checksum == entry->checksum) && (entries[j].size == entry->size) &&
+          !memcmp(payloads[j], payloads[i], entry->size)) {
+        entry->offset = entries[j].offset;
+        shared[i] = true;
+        break;
+      }
+    }
+    if (!shared[i]) {
+      entry->offset = offset;
+      offset = align_up(offset + entry->size, 16);
+    }
+
+    printf("%s page %u: '%s' at 0x%X%s\n", arguments[0], entry->page, arguments[4], entry->offset, shared[i] ? " (shared)" : "");
+  }
+
+  TexturePackHeader header;
+  memset(&header, 0x00, sizeof(header));
+  memcpy(header.magic, TEXTURE_PACK_MAGIC, 4);
+  header.version = TEXTURE_PACK_VERSION;
+  header.entry_count = entry_count;
+  header.entries_checksum = hash64(entries, entry_count * sizeof(TexturePackEntry), 0);
+
+  FILE* f = fopen(argv[1], "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to create '%s'\n", argv[1]);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(entries, sizeof(TexturePackEntry), entry_count, f);
+  for(uint32_t i = 0; i < entry_count; i++) {
+    if (!shared[i]) {
+      fseek(f, entries[i].offset, SEEK_SET);
+      fwrite(payloads[i], entries[i].size, 1, f);
+    }
+    free(payloads[i]);
+  }
+  bool written = (fflush(f) == 0) && !ferror(f);
+  fclose(f);
+  if (!written) {
+    fprintf(stderr, "Unable to write '%s'\n", argv[1]);
+    return 1;
+  }
+
+  printf("Packed %u textures into %u bytes (from %u bytes)\n", entry_count, offset, input_size);
+
+  free(shared);
+  free(payloads);
+  free(entries);
+
+  return 0;
+}
+
+#elif defined(HARNESS)
+
+// Maps the exe like the Windows loader would, so the harness can patch it in memory
+static bool map_image(Process* process, const char* path, uint32_t* image_base) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  size_t size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(size);
+  assert(data != NULL);
+  size_t read_count = fread(data, size, 1, f);
+  assert(read_count == 1);
+  fclose(f);
+
+  uint32_t coff_header;
+  memcpy(&coff_header, &data[0x3C], 4);
+  coff_header += 4;
+  uint16_t section_count;
+  uint16_t size_of_optional_header;
+  memcpy(&section_count, &data[coff_header + 2], 2);
+  memcpy(&size_of_optional_header, &data[coff_header + 16], 2);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t size_of_image;
+  uint32_t size_of_headers;
+  memcpy(image_base, &data[optional_header + 28], 4);
+  memcpy(&size_of_image, &data[optional_header + 56], 4);
+  memcpy(&size_of_headers, &data[optional_header + 60], 4);
+
+  // The exe can't be relocated, so it has to go to its preferred address
+  void* address = (void*)(uintptr_t)*image_base;
+#ifdef MAP_FIXED_NOREPLACE
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+#else
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+  void* memory = mmap(address, size_of_image, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (memory != address) {
+    fprintf(stderr, "Unable to map the exe at 0x%08X\n", *image_base);
+    free(data);
+    return false;
+  }
+
+  memcpy(memory, data, size_of_headers);
+  add_region(process, *image_base, align_up(size_of_headers, 0x1000), PROT_READ);
+  for(int i = 0; i < section_count; i++) {
+    const uint8_t* section_header = &data[optional_header + size_of_optional_header + i * 40];
+    uint32_t virtual_size;
+    uint32_t virtual_address;
+    uint32_t size_of_raw_data;
+    uint32_t pointer_to_raw_data;
+    uint32_t characteristics;
+    memcpy(&virtual_size, &section_header[8], 4);
+    memcpy(&virtual_address, &section_header[12], 4);
+    memcpy(&size_of_raw_data, &section_header[16], 4);
+    memcpy(&pointer_to_raw_data, &section_header[20], 4);
+    memcpy(&characteristics, &section_header[36], 4);
+
+    uint32_t raw_size = size_of_raw_data;
+    if ((virtual_size != 0) && (virtual_size < raw_size)) {
+      raw_size = virtual_size;
+    }
+    assert((pointer_to_raw_data + raw_size) <= size);
+    memcpy((uint8_t*)memory + virtual_address, &data[pointer_to_raw_data], raw_size);
+
+    int protection = PROT_READ;
+    if (characteristics & 0x20000000) {
+      protection |= PROT_EXEC;
+    }
+    if (characteristics & 0x80000000) {
+      protection |= PROT_WRITE;
+    }
+    uint32_t mapped_size = (virtual_size > size_of_raw_data) ? virtual_size : size_of_raw_data;
+    add_region(process, *image_base + virtual_address, align_up(mapped_size, 0x1000), protection);
+  }
+
+  free(data);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+
+  // Parse options, the remaining argument is the path of the exe
+  const char* path = NULL;
+  for(int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--threads=", 10)) {
+      thread_count = atoi(&argv[i][10]);
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+  if (path == NULL) {
+    fprintf(stderr, "Usage: %s [--threads=<count>] <path-to-swep1rcr.exe>\n", argv[0]);
+    return 1;
+  }
+
+  Process process;
+  memset(&process, 0x00, sizeof(process));
+
+  Plan plan;
+  init_plan(&plan);
+
+  Allocator allocator;
+
+  Target target;
+  target.process = &process;
+  target.plan = &plan;
+  target.allocator = &allocator;
+
+#ifdef REMOTE
+
+  // The child maps the exe and reserves memory, then it stops until it is killed
+  int fds[2];
+  int status = pipe(fds);
+  assert(status == 0);
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    close(fds[0]);
+    uint32_t addresses[2] = { 0, 0 };
+    if (map_image(&process, path, &addresses[0])) {
+      void* memory = mmap(NULL, patch_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+      addresses[1] = (memory != MAP_FAILED) ? (uintptr_t)memory : 0;
+    }
+    ssize_t written = write(fds[1], addresses, sizeof(addresses));
+    close(fds[1]);
+    if ((written == sizeof(addresses)) && (addresses[1] != 0)) {
+      raise(SIGSTOP);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  uint32_t addresses[2] = { 0, 0 };
+  ssize_t read_size = read(fds[0], addresses, sizeof(addresses));
+  close(fds[0]);
+  if ((read_size != sizeof(addresses)) || (addresses[1] == 0)) {
+    fprintf(stderr, "Unable to load '%s' in the child\n", path);
+    waitpid(pid, NULL, 0);
+    return 1;
+  }
+  int child_status;
+  waitpid(pid, &child_status, WUNTRACED);
+  assert(WIFSTOPPED(child_status));
+  process.pid = pid;
+
+  uint32_t image_base = addresses[0];
+  printf("Mapped '%s' at 0x%08X in process %d\n", path, image_base, (int)pid);
+
+#else
+
+  uint32_t image_base;
+  if (!map_image(&process, path, &image_base)) {
+    fprintf(stderr, "Unable to load '%s'\n", path);
+    return 1;
+  }
+  printf("Mapped '%s' at 0x%08X\n", path, image_base);
+
+#endif
+
+  uint32_t timestamp = read32(target, image_base + 212 + 4);
+  uint64_t fingerprint = fingerprint_image(target, image_base);
+  const Version* version = find_version(timestamp, fingerprint);
+  if (version == NULL) {
+    print_unknown_version(timestamp, fingerprint);
+    return 1;
+  }
+  printf("Detected version '%s', fingerprint %016llX\n", version->name, (unsigned long long)fingerprint);
+  target.addresses = &version->addresses;
+
+#ifdef REMOTE
+  uint32_t memory_offset = addresses[1];
+#else
+  // Only reserve the memory, it will be made accessible once we know what's used
+  void* memory = mmap(NULL, patch_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+  assert(memory != MAP_FAILED);
+  uint32_t memory_offset = (uintptr_t)memory;
+#endif
+  printf("Reserved memory at 0x%08X\n", memory_offset);
+  init_allocator(target.allocator, memory_offset, 0x1000, NULL);
+
+  Settings settings;
+  default_settings(&settings);
+  TexturePack pack;
+  bool opened = open_texture_pack(&pack, "textures/fonts.pack");
+  assert(opened);
+  patch(target, &settings, &pack);
+
+  // In-process, the game keeps using the mapped pack
+#ifndef IN_PROCESS
+  close_texture_pack(&pack);
+#endif
+
+  commit_arenas(target);
+  bool applied = apply_plan(target);
+  free_plan(&plan);
+  if (!applied) {
+    fprintf(stderr, "%s\nAborting.\n", plan.error);
+#ifdef REMOTE
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+#endif
+    return 1;
+  }
+
+  // Memory which is used by the patches
+  uint32_t committed = 0;
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    committed += align_up(allocator.arenas[i].size, 0x1000);
+  }
+#ifdef REMOTE
+  printf("Patched process %d, %u bytes used by the patches\n", (int)pid, committed);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+#else
+  printf("Patched in-process, %u bytes committed for the patches\n", committed);
+#endif
+
+  return 0;
+}
+
+#elif !defined(DLL)
+
+#ifndef LOADER
+
+// Pointer to `size` bytes at `address`, if they are all backed by the file
+static const uint8_t* image_bytes(Image* image, uint32_t address, uint32_t size) {
+  for(unsigned int i = 0; i < image->section_count; i++) {
+    MappedSection* section = &image->sections[i];
+    if ((address >= section->address) && ((address - section->address) <= section->size) &&
+        (size <= (section->size - (address - section->address)))) {
+      return &image->data[section->file_offset + (address - section->address)];
+    }
+  }
+  return NULL;
+}
+
+static void scan_image(Image* image, Scanner* scanner) {
+  for(unsigned int i = 0; i < image->section_count; i++) {
+    MappedSection* section = &image->sections[i];
+    scan_memory(scanner, &image->data[section->file_offset], section->size, section->address);
+  }
+  return;
+}
+
+// Masks bytes which usually differ between builds: absolute addresses in the
+// image and the targets of relative calls and jumps
+static unsigned int mask_signature(Signature* signature, uint32_t image_base, uint32_t image_size) {
+  memset(signature->mask, 0xFF, signature->size);
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if ((i + 4) <= signature->size) {
+      uint32_t value;
+      memcpy(&value, &signature->bytes[i], 4);
+      if ((value - image_base) < image_size) {
+        memset(&signature->mask[i], 0x00, 4);
+      }
+    }
+    if (((signature->bytes[i] == 0xE8) || (signature->bytes[i] == 0xE9)) && ((i + 5) <= signature->size)) {
+      memset(&signature->mask[i + 1], 0x00, 4);
+    }
+  }
+
+  unsigned int fixed = 0;
+  for(unsigned int i = 0; i < signature->size; i++) {
+    fixed += (signature->mask[i] == 0xFF);
+  }
+  return fixed;
+}
+
+// Checks if a signature only matches once in this exe
+static bool is_unique_signature(Image* image, Signature* signature, uint32_t image_base, uint32_t image_size) {
+  if ((mask_signature(signature, image_base, image_size) < 8) || !set_signature_anchor(signature)) {
+    return false;
+  }
+  Scanner scanner;
+  init_scanner(&scanner, signature, 1);
+  scan_image(image, &scanner);
+  return scanner.match_counts[0] == 1;
+}
+
+// Creates a signature for a site, from an exe where we know the address
+static bool learn_signature(Image* image, uint32_t image_base, uint32_t image_size, Site site, uint32_t address, Signature* signature) {
+  static const unsigned int sizes[] = { 16, 24, 32, 48, 64 };
+  const unsigned int size_count = sizeof(sizes) / sizeof(sizes[0]);
+
+  // Prefer the bytes at the site itself
+  for(unsigned int i = 0; i < size_count; i++) {
+    const uint8_t* bytes = image_bytes(image, address, sizes[i]);
+    if (bytes == NULL) {
+      break;
+    }
+    memset(signature, 0x00, sizeof(Signature));
+    signature->site = site;
+    signature->type = SIGNATURE_SITE;
+    signature->size = sizes[i];
+    memcpy(signature->bytes, bytes, sizes[i]);
+    if (is_unique_signature(image, signature, image_base, image_size)) {
+      return true;
+    }
+  }
+
+  // Otherwise use code which refers to the site
+  unsigned int references = 0;
+  for(unsigned int i = 0; i < image->section_count; i++) {
+    MappedSection* section = &image->sections[i];
+    const uint8_t* data = &image->data[section->file_offset];
+    for(uint32_t j = 0; (j + 4) <= section->size; j++) {
+      uint32_t value;
+      memcpy(&value, &data[j], 4);
+      if (value != address) {
+        continue;
+      }
+
+      // Give up on sites which are mentioned everywhere
+      if (++references > 16) {
+        return false;
+      }
+
+      for(unsigned int k = 0; k < size_count; k++) {
+        uint32_t start = (j > (sizes[k] / 2)) ? (j - sizes[k] / 2) : 0;
+        if ((start + sizes[k]) > section->size) {
+          break;
+        }
+        memset(signature, 0x00, sizeof(Signature));
+        signature->site = site;
+        signature->type = SIGNATURE_ABSOLUTE;
+        signature->offset = j - start;
+        signature->size = sizes[k];
+        memcpy(signature->bytes, &data[start], sizes[k]);
+        if (is_unique_signature(image, signature, image_base, image_size)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+static bool learn_signatures(Image* image, uint32_t image_base, uint32_t image_size, const Addresses* addresses, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  fprintf(f, "# <site> <site|absolute> <offset> <bytes>\n");
+  for(int i = 0; i < SITE_COUNT; i++) {
+    Signature signature;
+    if (learn_signature(image, image_base, image_size, i, addresses->address[i], &signature)) {
+      save_signature(f, &signature);
+    } else {
+      printf("Unable to find a signature for '%s'\n", site_names[i]);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+// Results of a scan are cached per exe fingerprint and set of signatures
+static bool load_cached_sites(const char* path, uint64_t key, Addresses* addresses) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  bool found = false;
+  char line[128];
+  while(fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long line_key;
+    char name[64];
+    uint32_t address;
+    if ((sscanf(line, "%llX %63s %X", &line_key, name, &address) != 3) || (line_key != key)) {
+      continue;
+    }
+    Site site = find_site(name);
+    if (site != SITE_COUNT) {
+      addresses->address[site] = address;
+      found = true;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+static void save_cached_sites(const char* path, uint64_t key, const Addresses* addresses) {
+  FILE* f = fopen(path, "a");
+  if (f == NULL) {
+    return;
+  }
+  for(int i = 0; i < SITE_COUNT; i++) {
+    if (addresses->address[i] != 0) {
+      fprintf(f, "%016llX %s 0x%08X\n", (unsigned long long)key, site_names[i], addresses->address[i]);
+    }
+  }
+  fclose(f);
+  return;
+}
+
+// Searches an unknown version of the game for all sites
+// Lists the sites which weren't found, returns false if there are any
+static bool check_addresses(const Addresses* addresses, char* error, size_t error_size) {
+  size_t length = snprintf(error, error_size, "Unable to find the patch locations:");
+  bool complete = true;
+  for(int i = 0; i < SITE_COUNT; i++) {
+    if (addresses->address[i] == 0) {
+      if (length < error_size) {
+        length += snprintf(&error[length], error_size - length, " %s", site_names[i]);
+      }
+      complete = false;
+    }
+  }
+  return complete;
+}
+
+// Every site must be found exactly once, otherwise the error names the missing ones
+static bool find_addresses(Image* image, const char* path, uint64_t fingerprint, Addresses* addresses, char* error, size_t error_size) {
+  Signature signatures[64];
+  unsigned int count = load_signatures(path, signatures, 64);
+  if (count == 0) {
+    snprintf(error, error_size, "No signatures found in '%s'", path);
+    return false;
+  }
+
+  memset(addresses, 0x00, sizeof(Addresses));
+  uint64_t key = hash64(signatures, count * sizeof(Signature), fingerprint);
+  char cache_path[1024];
+  snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
+  if (load_cached_sites(cache_path, key, addresses)) {
+    printf("Using cached sites for exe %016llX\n", (unsigned long long)key);
+    return check_addresses(addresses, error, error_size);
+  }
+
+  clock_t start = clock();
+  Scanner scanner;
+  init_scanner(&scanner, signatures, count);
+  scan_image(image, &scanner);
+  printf("Scanned for %u signatures in %.1f ms%s\n", count, (clock() - start) * 1000.0 / CLOCKS_PER_SEC, scan_uses_avx2() ? " with AVX2" : "");
+
+  for(unsigned int i = 0; i < count; i++) {
+    Site site = signatures[i].site;
+    if (scanner.match_counts[i] == 1) {
+      addresses->address[site] = scanner.results[i];
+      printf("Found '%s' at 0x%08X\n", site_names[site], scanner.results[i]);
+    } else {
+      printf("Signature for '%s' matched %u times\n", site_names[site], scanner.match_counts[i]);
+    }
+  }
+
+  save_cached_sites(cache_path, key, addresses);
+  return check_addresses(addresses, error, error_size);
+}
+
+// Deltas use the BPS format, so they can also be applied with common tools.
+// All numbers are variable length, the footer holds CRC32s of source, target and delta.
+#define DELTA_MAGIC "BPS1"
+#define DELTA_SOURCE_READ 0
+#define DELTA_TARGET_READ 1
+#define DELTA_SOURCE_COPY 2
+#define DELTA_TARGET_COPY 3
+
+// Shorter matches take more space than the literal bytes
+#define DELTA_MIN_MATCH 4
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+} Delta;
+
+static uint32_t crc32_table[256];
+
+static void init_crc32_table(void) {
+  for(uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for(int j = 0; j < 8; j++) {
+      c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+    }
+    crc32_table[i] = c;
+  }
+  return;
+}
+
+static uint32_t crc32(uint32_t crc, const void* data, size_t size) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_crc32_table);
+
+  const uint8_t* p = data;
+  crc = ~crc;
+  for(size_t i = 0; i < size; i++) {
+    crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void delta_bytes(Delta* delta, const void* data, size_t size) {
+  while ((delta->size + size) > delta->capacity) {
+    delta->capacity = delta->capacity ? delta->capacity * 2 : 0x10000;
+    delta->data = realloc(delta->data, delta->capacity);
+    assert(delta->data != NULL);
+  }
+  memcpy(&delta->data[delta->size], data, size);
+  delta->size += size;
+  return;
+}
+
+static void delta_number(Delta* delta, uint64_t value) {
+  while(true) {
+    uint8_t x = value & 0x7F;
+    value >>= 7;
+    if (value == 0) {
+      x |= 0x80;
+      delta_bytes(delta, &x, 1);
+      break;
+    }
+    delta_bytes(delta, &x, 1);
+    value--;
+  }
+  return;
+}
+
+static void delta_command(Delta* delta, unsigned int command, size_t length) {
+  delta_number(delta, ((uint64_t)(length - 1) << 2) | command);
+  return;
+}
+
+// Copy offsets are relative to the end of the previous copy
+static void delta_offset(Delta* delta, int64_t offset) {
+  uint64_t value = (offset < 0) ? (uint64_t)-offset : (uint64_t)offset;
+  delta_number(delta, (value << 1) | (offset < 0));
+  return;
+}
+
+// Number of bytes at `position` which are unchanged from the source
+static size_t source_match(const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size, size_t position) {
+  size_t end = (source_size < target_size) ? source_size : target_size;
+  size_t length = 0;
+  while(((position + length) < end) && (source[position + length] == target[position + length])) {
+    length++;
+  }
+  return length;
+}
+
+// Number of bytes at `position` which repeat the previous byte
+static size_t repeat_match(const uint8_t* target, size_t target_size, size_t position) {
+  if (position == 0) {
+    return 0;
+  }
+  size_t length = 0;
+  while(((position + length) < target_size) && (target[position + length] == target[position - 1])) {
+    length++;
+  }
+  return length;
+}
+
+static void encode_delta(Delta* delta, const void* metadata, size_t metadata_size, const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size) {
+  memset(delta, 0x00, sizeof(Delta));
+  delta_bytes(delta, DELTA_MAGIC, 4);
+  delta_number(delta, source_size);
+  delta_number(delta, target_size);
+  delta_number(delta, metadata_size);
+  delta_bytes(delta, metadata, metadata_size);
+
+  // Patches only touch a few places, so matches are only looked for at the same offset.
+  // Runs (mostly padding and empty texture rows) are copied from the previous byte.
+  size_t position = 0;
+  size_t literal = 0;
+  size_t target_relative = 0;
+  while(position <= target_size) {
+    size_t match = 0;
+    size_t repeat = 0;
+    if (position < target_size) {
+      match = source_match(source, source_size, target, target_size, position);
+      if (match < DELTA_MIN_MATCH) {
+        repeat = repeat_match(target, target_size, position);
+      }
+      if ((match < DELTA_MIN_MATCH) && (repeat < DELTA_MIN_MATCH)) {
+        position++;
+        continue;
+      }
+    }
+
+    // Flush the pending literal bytes
+    if (position > literal) {
+      delta_command(delta, DELTA_TARGET_READ, position - literal);
+      delta_bytes(delta, &target[literal], position - literal);
+    }
+    if (position == target_size) {
+      break;
+    }
+
+    if (match >= DELTA_MIN_MATCH) {
+      delta_command(delta, DELTA_SOURCE_READ, match);
+      position += match;
+    } else {
+      delta_command(delta, DELTA_TARGET_COPY, repeat);
+      delta_offset(delta, (int64_t)(position - 1) - (int64_t)target_relative);
+      target_relative = position - 1 + repeat;
+      position += repeat;
+    }
+    literal = position;
+  }
+
+  uint32_t checksums[2];
+  checksums[0] = crc32(0, source, source_size);
+  checksums[1] = crc32(0, target, target_size);
+  delta_bytes(delta, checksums, sizeof(checksums));
+  uint32_t checksum = crc32(0, delta->data, delta->size);
+  delta_bytes(delta, &checksum, sizeof(checksum));
+  return;
+}
+
+static bool write_delta(const char* path, const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size) {
+  Delta delta;
+  encode_delta(&delta, "", 0, source, source_size, target, target_size);
+
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    free(delta.data);
+    return false;
+  }
+  size_t write_count = fwrite(delta.data, delta.size, 1, f);
+  fclose(f);
+  printf("Wrote %zu byte delta for %zu byte exe to '%s'\n", delta.size, target_size, path);
+  free(delta.data);
+  return write_count == 1;
+}
+
+static bool read_delta_number(const uint8_t** p, const uint8_t* end, uint64_t* value) {
+  uint64_t data = 0;
+  uint64_t shift = 1;
+  while(true) {
+    if (*p == end) {
+      return false;
+    }
+    uint8_t x = *(*p)++;
+    data += (x & 0x7F) * shift;
+    if (x & 0x80) {
+      break;
+    }
+    shift <<= 7;
+    data += shift;
+  }
+  *value = data;
+  return true;
+}
+
+// Finds the metadata of a delta, without checking anything else
+static bool read_delta_metadata(const uint8_t* delta, size_t delta_size, const uint8_t** metadata, size_t* metadata_size) {
+  if ((delta_size < 16) || memcmp(delta, DELTA_MAGIC, 4)) {
+    return false;
+  }
+  const uint8_t* p = &delta[4];
+  const uint8_t* end = &delta[delta_size - 12];
+  uint64_t source_size;
+  uint64_t target_size;
+  uint64_t size;
+  if (!read_delta_number(&p, end, &source_size) ||
+      !read_delta_number(&p, end, &target_size) ||
+      !read_delta_number(&p, end, &size) ||
+      (size > (uint64_t)(end - p))) {
+    return false;
+  }
+  *metadata = p;
+  *metadata_size = size;
+  return true;
+}
+
+static bool read_delta_offset(const uint8_t** p, const uint8_t* end, size_t* relative, size_t size, size_t length) {
+  uint64_t value;
+  if (!read_delta_number(p, end, &value)) {
+    return false;
+  }
+  int64_t offset = (value & 1) ? -(int64_t)(value >> 1) : (int64_t)(value >> 1);
+  if ((offset < -(int64_t)*relative) || ((*relative + offset) > size) || (length > (size - (*relative + offset)))) {
+    return false;
+  }
+  *relative += offset;
+  return true;
+}
+
+// Rebuilds the target from the source in a single pass over both files
+static bool decode_delta(const uint8_t* delta, size_t delta_size, const uint8_t* source, size_t source_size, uint8_t** target, size_t* target_size) {
+  if ((delta_size < 16) || memcmp(delta, DELTA_MAGIC, 4)) {
+    printf("Not a delta file\n");
+    return false;
+  }
+  uint32_t checksums[3];
+  memcpy(checksums, &delta[delta_size - 12], 12);
+  if (crc32(0, delta, delta_size - 4) != checksums[2]) {
+    printf("Delta file is corrupt\n");
+    return false;
+  }
+  if (crc32(0, source, source_size) != checksums[0]) {
+    printf("Delta does not apply to this exe\n");
+    return false;
+  }
+
+  const uint8_t* p = &delta[4];
+  const uint8_t* end = &delta[delta_size - 12];
+  uint64_t expected_source_size;
+  uint64_t expected_target_size;
+  uint64_t metadata_size;
+  bool valid = read_delta_number(&p, end, &expected_source_size) &&
+               read_delta_number(&p, end, &expected_target_size) &&
+               read_delta_number(&p, end, &metadata_size) &&
+               (expected_source_size == source_size) &&
+               (metadata_size <= (uint64_t)(end - p));
+  if (!valid) {
+    printf("Delta file is invalid\n");
+    return false;
+  }
+  p += metadata_size;
+
+  size_t size = expected_target_size;
+  uint8_t* out = malloc(size);
+  assert(out != NULL);
+  size_t position = 0;
+  size_t source_relative = 0;
+  size_t target_relative = 0;
+  while(valid && (p < end)) {
+    uint64_t command;
+    valid = read_delta_number(&p, end, &command);
+    size_t length = (command >> 2) + 1;
+    if (!valid || (length > (size - position))) {
+      valid = false;
+      break;
+    }
+    switch(command & 3) {
+    case DELTA_SOURCE_READ:
+      valid = (position + length) <= source_size;
+      if (valid) {
+        memcpy(&out[position], &source[position], length);
+      }
+      break;
+    case DELTA_TARGET_READ:
+      valid = length <= (size_t)(end - p);
+      if (valid) {
+        memcpy(&out[position], p, length);
+        p += length;
+      }
+      break;
+    case DELTA_SOURCE_COPY:
+      valid = read_delta_offset(&p, end, &source_relative, source_size, length);
+      if (valid) {
+        memcpy(&out[position], &source[source_relative], length);
+        source_relative += length;
+      }
+      break;
+    case DELTA_TARGET_COPY:
+      valid = read_delta_offset(&p, end, &target_relative, position, 1);
+      // Overlapping copies repeat the bytes, so this has to go byte by byte
+      for(size_t i = 0; valid && (i < length); i++) {
+        out[position + i] = out[target_relative++];
+      }
+      break;
+    }
+    position += length;
+  }
+  if (!valid || (position != size) || (crc32(0, out, size) != checksums[1])) {
+    printf("Delta file is invalid\n");
+    free(out);
+    return false;
+  }
+
+  *target = out;
+  *target_size = size;
+  return true;
+}
+
+// Has to be increased whenever the patches write different bytes for the same input.
+// It's part of the cache key, so older results and journals are no longer reused.
+#define PATCH_VERSION 1
+
+// Results are cached as deltas against the original exe.
+// The key is also stored in the delta, so a lookup only hits if everything matches.
+typedef struct {
+  uint32_t patch_version;
+  uint64_t exe_size;
+  uint64_t exe_hash;
+  uint64_t signatures_hash;
+  uint64_t textures_checksum;
+  Settings settings;
+} CacheKey;
+
+static void make_cache_key(CacheKey* key, const Image* image, const Settings* settings, const TexturePack* pack, const char* signatures_path) {
+  memset(key, 0x00, sizeof(CacheKey));
+  key->patch_version = PATCH_VERSION;
+
+  key->exe_size = image->size;
+  key->exe_hash = hash64(image->data, image->size, 0);
+
+  // Signatures decide where unknown builds are patched
+  if (signatures_path != NULL) {
+    MappedFile signatures;
+    if (map_file(&signatures, signatures_path)) {
+      key->signatures_hash = hash64(signatures.data, signatures.size, 0);
+      unmap_file(&signatures);
+    }
+  }
+
+  // The table of the pack holds the checksum of each texture
+  if (settings->fonts) {
+    key->textures_checksum = pack->header->entries_checksum;
+  }
+
+  memcpy(&key->settings, settings, sizeof(Settings));
+  return;
+}
+
+static void get_cache_path(char* path, size_t size, const char* cache_path, const CacheKey* key) {
+  snprintf(path, size, "%s/%016llX.bps", cache_path, (unsigned long long)hash64(key, sizeof(CacheKey), 0));
+  return;
+}
+
+// Replaces the contents of the image with the cached result
+static bool load_cached_result(const char* cache_path, const CacheKey* key, Image* image) {
+  char path[1024];
+  get_cache_path(path, sizeof(path), cache_path, key);
+  MappedFile delta;
+  if (!map_file(&delta, path)) {
+    return false;
+  }
+
+  const uint8_t* metadata;
+  size_t metadata_size;
+  uint8_t* data = NULL;
+  size_t size;
+  bool hit = read_delta_metadata(delta.data, delta.size, &metadata, &metadata_size) &&
+             (metadata_size == sizeof(CacheKey)) && !memcmp(metadata, key, sizeof(CacheKey)) &&
+             decode_delta(delta.data, delta.size, image->data, image->size, &data, &size);
+  unmap_file(&delta);
+  if (!hit) {
+    return false;
+  }
+
+  printf("Using cached result '%s'\n", path);
+
+  // The delta doesn't say which bytes changed, so all of them have to be written
+  image->dirty_valid = false;
+  free(image->data);
+  image->data = data;
+  image->size = size;
+  image->content_size = size;
+  return true;
+}
+
+static void save_cached_result(const char* cache_path, const CacheKey* key, const uint8_t* source, size_t source_size, const uint8_t* target, size_t target_size) {
+  Delta delta;
+  encode_delta(&delta, key, sizeof(CacheKey), source, source_size, target, target_size);
+
+  // Written under a temporary name, so other patchers never see a partial entry
+  char path[1024];
+  char temporary_path[1100];
+  get_cache_path(path, sizeof(path), cache_path, key);
+  snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", path, (int)getpid());
+  FILE* f = fopen(temporary_path, "wb");
+  if (f != NULL) {
+    size_t write_count = fwrite(delta.data, delta.size, 1, f);
+    fclose(f);
+    if ((write_count != 1) || (rename(temporary_path, path) != 0)) {
+      remove(temporary_path);
+    }
+  }
+  free(delta.data);
+  return;
+}
+
+static void update_cache_stats(const char* cache_path, bool hit, bool report) {
+
+  // Patchers in the same process would otherwise lose each others updates
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&mutex);
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/stats", cache_path);
+
+  unsigned long long hits = 0;
+  unsigned long long misses = 0;
+  FILE* f = fopen(path, "r");
+  if (f != NULL) {
+    if (fscanf(f, "hits %llu misses %llu", &hits, &misses) != 2) {
+      hits = 0;
+      misses = 0;
+    }
+    fclose(f);
+  }
+  if (hit) {
+    hits++;
+  } else {
+    misses++;
+  }
+  f = fopen(path, "w");
+  if (f != NULL) {
+    fprintf(f, "hits %llu misses %llu\n", hits, misses);
+    fclose(f);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (report) {
+    printf("Cache %s, %llu hits and %llu misses in total\n", hit ? "hit" : "miss", hits, misses);
+  }
+  return;
+}
+
+// Optional output engine for batches on Linux.
+// Each exe is written to a temporary file with io_uring. Once the write completed
+// in full, a linked fsync and rename is queued, so slow disks don't hold up the patching.
+// Reads stay synchronous: a worker can't do anything with an exe before all of it was read,
+// and the workers of a batch already read different exes at the same time.
+#ifdef IO_URING
+
+// Chains which may be in flight at once, each one takes 3 entries
+#define URING_ENTRIES 128
+#define URING_MAX_CHAINS 32
+
+typedef struct {
+  int fd;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned int in_flight;
+  pthread_mutex_t mutex;
+} Uring;
+
+typedef struct {
+  int fd;
+  uint8_t* data;
+  size_t size;
+  char path[1024];
+  char temporary_path[1100];
+  unsigned int pending;
+  bool failed;
+  const char** error;
+} UringOutput;
+
+static int uring_enter(Uring* uring, unsigned int submit_count, unsigned int wait_count) {
+  while(true) {
+    int ret = syscall(__NR_io_uring_enter, uring->fd, submit_count, wait_count, (wait_count > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if ((ret >= 0) || (errno != EINTR)) {
+      return ret;
+    }
+  }
+}
+
+static void close_uring(Uring* uring) {
+  munmap(uring->sqes, uring->sqes_size);
+  if (uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->fd);
+  pthread_mutex_destroy(&uring->mutex);
+  return;
+}
+
+// Returns false if io_uring is missing, disabled or lacks an operation we need
+static bool init_uring(Uring* uring) {
+  memset(uring, 0x00, sizeof(Uring));
+
+  struct io_uring_params params;
+  memset(&params, 0x00, sizeof(params));
+  uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (uring->fd < 0) {
+    return false;
+  }
+
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    close(uring->fd);
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
+  } else {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_size);
+      close(uring->fd);
+      return false;
+    }
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  pthread_mutex_init(&uring->mutex, NULL);
+  if (uring->sqes == MAP_FAILED) {
+    uring->sqes_size = 0;
+    uring->sqes = NULL;
+    close_uring(uring);
+    return false;
+  }
+
+  uint8_t* sq = uring->sq_ring;
+  uring->sq_head = (unsigned int*)&sq[params.sq_off.head];
+  uring->sq_tail = (unsigned int*)&sq[params.sq_off.tail];
+  uring->sq_mask = (unsigned int*)&sq[params.sq_off.ring_mask];
+  uring->sq_array = (unsigned int*)&sq[params.sq_off.array];
+  uint8_t* cq = uring->cq_ring;
+  uring->cq_head = (unsigned int*)&cq[params.cq_off.head];
+  uring->cq_tail = (unsigned int*)&cq[params.cq_off.tail];
+  uring->cq_mask = (unsigned int*)&cq[params.cq_off.ring_mask];
+  uring->cqes = (struct io_uring_cqe*)&cq[params.cq_off.cqes];
+
+  // Renames are only supported since Linux 5.11
+  struct {
+    struct io_uring_probe probe;
+    struct io_uring_probe_op ops[256];
+  } probe;
+  memset(&probe, 0x00, sizeof(probe));
+  bool supported = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, &probe, 256) == 0;
+  uint8_t required_ops[] = { IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_RENAMEAT };
+  for(unsigned int i = 0; supported && (i < sizeof(required_ops)); i++) {
+    supported = (required_ops[i] <= probe.probe.last_op) && (probe.ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  if (!supported) {
+    close_uring(uring);
+    return false;
+  }
+  return true;
+}
+
+// The low bits of the user data tell which step of the chain completed
+#define URING_STEP_WRITE 0
+#define URING_STEP_FSYNC 1
+#define URING_STEP_RENAME 2
+
+static struct io_uring_sqe* uring_sqe(Uring* uring, unsigned int tail, uint8_t opcode, UringOutput* output, unsigned int step) {
+  unsigned int index = tail & *uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[index];
+  memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = (uintptr_t)output | step;
+  uring->sq_array[index] = index;
+  return sqe;
+}
+
+static void submit_uring(Uring* uring, unsigned int tail, unsigned int count) {
+  __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+  int submitted = uring_enter(uring, count, 0);
+  assert(submitted == (int)count);
+  return;
+}
+
+// The fsync and rename may only run once the whole file has been written
+static void queue_rename(Uring* uring, UringOutput* output) {
+  unsigned int tail = *uring->sq_tail;
+  struct io_uring_sqe* sqe = uring_sqe(uring, tail++, IORING_OP_FSYNC, output, URING_STEP_FSYNC);
+  sqe->fd = output->fd;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe = uring_sqe(uring, tail++, IORING_OP_RENAMEAT, output, URING_STEP_RENAME);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)output->temporary_path;
+  sqe->len = AT_FDCWD;
+  sqe->addr2 = (uintptr_t)output->path;
+  output->pending += 2;
+  submit_uring(uring, tail, 2);
+  return;
+}
+
+// Handles all completions, or waits for at least one
+static void reap_uring(Uring* uring, bool wait) {
+  if (wait) {
+    uring_enter(uring, 0, 1);
+  }
+  unsigned int head = *uring->cq_head;
+  unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  while(head != tail) {
+    struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+    UringOutput* output = (UringOutput*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+    unsigned int step = cqe->user_data & 3;
+    output->pending--;
+
+    // The write is not linked to the rest: when the kernel has to finish a partial
+    // buffered write in a worker, it fails the link although the CQE reports every byte.
+    // Any error or cancellation after that is a real failure.
+    if (step == URING_STEP_WRITE) {
+      if ((cqe->res >= 0) && ((size_t)cqe->res == output->size)) {
+        queue_rename(uring, output);
+      } else {
+        output->failed = true;
+      }
+    } else if (cqe->res < 0) {
+      output->failed = true;
+    }
+    if (output->pending == 0) {
+      close(output->fd);
+      if (output->failed) {
+        unlink(output->temporary_path);
+        *output->error = "Unable to write file";
+      }
+      free(output->data);
+      free(output);
+      uring->in_flight--;
+    }
+    head++;
+  }
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+  return;
+}
+
+// Takes over the contents of the image, the result is reported once the chain completed
+static void queue_output(Uring* uring, Image* image, const char** error) {
+  UringOutput* output = malloc(sizeof(UringOutput));
+  assert(output != NULL);
+  memset(output, 0x00, sizeof(UringOutput));
+  output->error = error;
+
+  // The replacement gets the permissions of the original
+  struct stat st;
+  int status = fstat(fileno(image->f), &st);
+  snprintf(output->path, sizeof(output->path), "%s", image->path);
+  snprintf(output->temporary_path, sizeof(output->temporary_path), "%s.%d.tmp", image->path, (int)getpid());
+  output->fd = open(output->temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (status == 0) ? (st.st_mode & 07777) : 0644);
+  fclose(image->f);
+
+  // Padding which was never written is left to the filesystem (sparse)
+  if ((output->fd == -1) || (ftruncate(output->fd, image->size) != 0)) {
+    if (output->fd != -1) {
+      close(output->fd);
+      unlink(output->temporary_path);
+    }
+    *error = "Unable to write file";
+    free(image->data);
+    free(image->dirty);
+    free(output);
+    return;
+  }
+
+  // Only the data is kept until the chain completed
+  output->data = image->data;
+  output->size = image->content_size;
+  free(image->dirty);
+
+  pthread_mutex_lock(&uring->mutex);
+  while(uring->in_flight >= URING_MAX_CHAINS) {
+    reap_uring(uring, true);
+  }
+
+  unsigned int tail = *uring->sq_tail;
+  struct io_uring_sqe* sqe = uring_sqe(uring, tail++, IORING_OP_WRITE, output, URING_STEP_WRITE);
+  sqe->fd = output->fd;
+  sqe->addr = (uintptr_t)output->data;
+  sqe->len = output->size;
+  sqe->off = 0;
+  output->pending = 1;
+  uring->in_flight++;
+  submit_uring(uring, tail, 1);
+  reap_uring(uring, false);
+  pthread_mutex_unlock(&uring->mutex);
+  return;
+}
+
+// Waits until every queued exe has been written
+static void drain_uring(Uring* uring) {
+  pthread_mutex_lock(&uring->mutex);
+  while(uring->in_flight > 0) {
+    reap_uring(uring, true);
+  }
+  pthread_mutex_unlock(&uring->mutex);
+  return;
+}
+
+#else
+
+typedef struct {
+  int unused;
+} Uring;
+
+static bool init_uring(Uring* uring) {
+  return false;
+}
+
+static void close_uring(Uring* uring) {
+  return;
+}
+
+static void queue_output(Uring* uring, Image* image, const char** error) {
+  assert(false);
+  return;
+}
+
+static void drain_uring(Uring* uring) {
+  return;
+}
+
+#endif
+
+#ifndef _WIN32
+static bool write_all(int fd, const uint8_t* data, size_t size, off_t offset) {
+  while(size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Copies a file inside the kernel, ideally by sharing the blocks of the original
+static const char* copy_file(int fd, int source, size_t size) {
+#ifdef FICLONE
+  if (ioctl(fd, FICLONE, source) == 0) {
+    return "cloned";
+  }
+#endif
+#ifdef __NR_copy_file_range
+  loff_t in_offset = 0;
+  loff_t out_offset = 0;
+  size_t remaining = size;
+  while(remaining > 0) {
+    ssize_t copied = syscall(__NR_copy_file_range, source, &in_offset, fd, &out_offset, remaining, 0);
+    if (copied <= 0) {
+      break;
+    }
+    remaining -= copied;
+  }
+  if (remaining == 0) {
+    return "copied";
+  }
+#endif
+  return NULL;
+}
+
+#endif
+
+// Writes the patched image to a new file, the original is left untouched.
+// The result only becomes visible once it's complete.
+static bool write_output(Image* image, const char* path) {
+  char temporary_path[1100];
+  snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", path, (int)getpid());
+
+#ifdef _WIN32
+  FILE* f = fopen(temporary_path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  bool written = (fwrite(image->data, image->size, 1, f) == 1) && (fflush(f) == 0) && (_commit(_fileno(f)) == 0);
+  fclose(f);
+  if (!written || !MoveFileExA(temporary_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    remove(temporary_path);
+    return false;
+  }
+  printf("Wrote '%s'\n", path);
+#else
+  int source = fileno(image->f);
+  struct stat st;
+  if (fstat(source, &st) != 0) {
+    return false;
+  }
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if (fd == -1) {
+    return false;
+  }
+
+  // Only the changed ranges have to be written on top of a copy
+  bool written = true;
+  size_t written_size = 0;
+  const char* method = copy_file(fd, source, st.st_size);
+  if ((method != NULL) && image->dirty_valid) {
+    written = ftruncate(fd, image->size) == 0;
+    for(size_t i = 0; written && (i < image->dirty_count); i++) {
+      FileRange* range = &image->dirty[i];
+      written = write_all(fd, &image->data[range->offset], range->size, range->offset);
+      written_size += range->size;
+    }
+  } else {
+    method = "written";
+    written = (ftruncate(fd, image->size) == 0) && write_all(fd, image->data, image->content_size, 0);
+    written_size = image->content_size;
+  }
+  written = written && (fsync(fd) == 0);
+  close(fd);
+  if (!written || (rename(temporary_path, path) != 0)) {
+    unlink(temporary_path);
+    return false;
+  }
+  printf("Wrote '%s' (%s, %zu bytes written)\n", path, method, written_size);
+#endif
+
+  return true;
+}
+
+// Replaces the exe with the result of a delta, or writes the result to another file.
+// The exe is only replaced once the result has been verified and completely written.
+static bool apply_delta(const char* path, const char* delta_path, const char* output_path) {
+  MappedFile delta;
+  if (!map_file(&delta, delta_path)) {
+    printf("Unable to open '%s'\n", delta_path);
+    return false;
+  }
+  Image image;
+  if (!load_image(&image, path)) {
+    printf("Unable to open '%s'\n", path);
+    unmap_file(&delta);
+    return false;
+  }
+
+  uint8_t* target;
+  size_t target_size;
+  bool decoded = decode_delta(delta.data, delta.size, image.data, image.size, &target, &target_size);
+  unmap_file(&delta);
+  if (!decoded) {
+    discard_image(&image);
+    return false;
+  }
+
+  // The delta doesn't say which bytes changed, so all of them have to be written
+  image.dirty_valid = false;
+  free(image.data);
+  image.data = target;
+  image.size = target_size;
+  image.content_size = target_size;
+
+  bool written = write_output(&image, (output_path != NULL) ? output_path : path);
+  discard_image(&image);
+  if (!written) {
+    printf("Unable to write '%s'\n", (output_path != NULL) ? output_path : path);
+    return false;
+  }
+  printf("Applied '%s' to '%s'\n", delta_path, path);
+  return true;
+}
+
+// Writes the patched image, or only the delta to the original.
+// With an output engine, errors while writing are reported later.
+static bool finish_image(Image* image, const char* emit_delta_path, const char* output_path, uint8_t* original, size_t original_size, Uring* uring, const char** error) {
+  if ((emit_delta_path == NULL) && (output_path != NULL)) {
+    free(original);
+    bool written = write_output(image, output_path);
+    discard_image(image);
+    if (!written) {
+      *error = "Unable to write the output";
+    }
+    return written;
+  }
+  if (emit_delta_path == NULL) {
+    free(original);
+    if (uring != NULL) {
+      queue_output(uring, image, error);
+    } else {
+      close_image(image);
+    }
+    return true;
+  }
+
+  // When emitting a delta, the exe itself is left untouched
+  bool written = write_delta(emit_delta_path, original, original_size, image->data, image->size);
+  free(original);
+  discard_image(image);
+  if (!written) {
+    *error = "Unable to write the delta";
+  }
+  return written;
+}
+
+// The original bytes of everything which is changed in place are kept in their own section.
+// All integers are little endian, the entries are followed by the bytes they describe.
+// The manifest describes how the exe was patched, its hash is also used to verify the restored exe.
+#define JOURNAL_MAGIC "SWUJ"
+#define JOURNAL_VERSION 3
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t original_size;
+  uint32_t entry_count;
+  CacheKey manifest;
+} JournalHeader;
+
+typedef struct {
+  uint32_t file_offset;
+  uint32_t size;
+} JournalEntry;
+
+static int compare_ranges(const void* a, const void* b) {
+  const FileRange* ra = a;
+  const FileRange* rb = b;
+  return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+// Must run after the patches, but before the plan is applied, as it reads the original bytes
+static void write_journal(Target target, const Settings* settings, const TexturePack* pack, const char* signatures_path, const FileRange* extra_ranges, size_t extra_count) {
+  Plan* plan = target.plan;
+  if (!plan->measuring) {
+    trace_stage("journal");
+  }
+  Image* image = target.image;
+  uint32_t patch_begin = target.allocator->arenas[0].base;
+  uint32_t patch_end = allocator_end(target.allocator);
+
+  FileRange* ranges = malloc((plan->record_count + extra_count) * sizeof(FileRange));
+  assert(ranges != NULL);
+  size_t count = 0;
+  for(size_t i = 0; i < plan->record_count; i++) {
+    PatchRecord* record = &plan->records[i];
+    if ((record->address >= patch_begin) && (record->address < patch_end)) {
+      continue;
+    }
+    off_t file_offset = mapExe(image, record->address);
+    if (file_offset < 0) {
+      plan_error(plan, "Address 0x%08X is not in any section of the file", record->address);
+      continue;
+    }
+    ranges[count].offset = file_offset;
+    ranges[count].size = record->size;
+    count++;
+  }
+  memcpy(&ranges[count], extra_ranges, extra_count * sizeof(FileRange));
+  count += extra_count;
+
+  // Close ranges are merged, as each entry costs as much as a few bytes
+  qsort(ranges, count, sizeof(FileRange), compare_ranges);
+  size_t merged_count = 0;
+  size_t data_size = 0;
+  for(size_t i = 0; i < count; i++) {
+    if (merged_count > 0) {
+      FileRange* last = &ranges[merged_count - 1];
+      if (ranges[i].offset <= (last->offset + last->size + sizeof(JournalEntry))) {
+        size_t end = ranges[i].offset + ranges[i].size;
+        if (end > (last->offset + last->size)) {
+          data_size += end - (last->offset + last->size);
+          last->size = end - last->offset;
+        }
+        continue;
+      }
+    }
+    ranges[merged_count++] = ranges[i];
+    data_size += ranges[i].size;
+  }
 
-  // Read the section8.trigger_action field
-  //3:  0f b7 40 24             movzx  eax,WORD PTR [eax+0x24] 
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0xB7); memory_offset += 1;
-  write8(target, memory_offset, 0x40); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
+  size_t size = sizeof(JournalHeader) + merged_count * sizeof(JournalEntry) + data_size;
+  uint8_t* journal = malloc(size);
+  assert(journal != NULL);
+  JournalHeader* header = (JournalHeader*)journal;
+  memcpy(header->magic, JOURNAL_MAGIC, 4);
+  header->version = JOURNAL_VERSION;
+  header->original_size = image->size;
+  header->entry_count = merged_count;
+  make_cache_key(&header->manifest, image, settings, pack, signatures_path);
+  JournalEntry* entries = (JournalEntry*)&journal[sizeof(JournalHeader)];
+  uint8_t* data = (uint8_t*)&entries[merged_count];
+  for(size_t i = 0; i < merged_count; i++) {
+    entries[i].file_offset = ranges[i].offset;
+    entries[i].size = ranges[i].size;
+    memcpy(data, &image->data[ranges[i].offset], ranges[i].size);
+    data += ranges[i].size;
+  }
 
-  // Make room for sprintf buffer and keep the pointer in edx
-  //  -> add     esp, -400h
-  memory_offset = add_esp(target, memory_offset, -0x400);
-  //  -> mov     edx, esp
-  write8(target, memory_offset, 0x89); memory_offset += 1;
-  write8(target, memory_offset, 0xE2); memory_offset += 1;
+  begin_patch(target, "journal");
+  uint32_t address = allocate(target, ARENA_JOURNAL, size);
+  write_data(target, address, journal, size);
+  patch_log(plan, "Journal has %zu entries with %zu bytes\n", merged_count, data_size);
 
-  // Generate the string we'll display
-  memory_offset = push_eax(target, memory_offset); // (trigger index)
-  memory_offset = push_u32(target, memory_offset, memory_offset_trigger_string); // (fmt)
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x49EB80); // sprintf
-  memory_offset = pop_edx(target, memory_offset); // (buffer)
-  memory_offset = add_esp(target, memory_offset, 0x8);
+  free(journal);
+  free(ranges);
+  return;
+}
 
-  // Display a message
-  memory_offset = push_u32(target, memory_offset, *(uint32_t*)&trigger_string_display_duration);
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x44FCE0);
-  memory_offset = add_esp(target, memory_offset, 0x8);
+// Restores the original exe from the journal section, and returns how it had been patched
+static const char* unpatch_image(Image* image, uint32_t pointer_to_raw_data, uint32_t size_of_raw_data, CacheKey* manifest) {
 
-  // Pop the string buffer off of the stack
-  memory_offset = add_esp(target, memory_offset, 0x400);
+  // Copy the journal first, it's part of what is removed
+  if ((pointer_to_raw_data > image->size) || (size_of_raw_data > (image->size - pointer_to_raw_data)) ||
+      (size_of_raw_data < sizeof(JournalHeader))) {
+    return "The undo journal is damaged";
+  }
+  uint8_t* journal = malloc(size_of_raw_data);
+  assert(journal != NULL);
+  memcpy(journal, &image->data[pointer_to_raw_data], size_of_raw_data);
+
+  const JournalHeader* header = (const JournalHeader*)journal;
+  const JournalEntry* entries = (const JournalEntry*)&journal[sizeof(JournalHeader)];
+  size_t available = size_of_raw_data - sizeof(JournalHeader);
+  bool valid = !memcmp(header->magic, JOURNAL_MAGIC, 4) &&
+               (header->version == JOURNAL_VERSION) &&
+               (header->original_size <= image->size) &&
+               ((available / sizeof(JournalEntry)) >= header->entry_count);
+  const uint8_t* data = (const uint8_t*)&entries[valid ? header->entry_count : 0];
+  available -= valid ? (header->entry_count * sizeof(JournalEntry)) : 0;
+  for(uint32_t i = 0; valid && (i < header->entry_count); i++) {
+    const JournalEntry* entry = &entries[i];
+    valid = (entry->size <= available) &&
+            (entry->file_offset <= header->original_size) &&
+            (entry->size <= (header->original_size - entry->file_offset));
+    if (valid) {
+      memcpy(&image->data[entry->file_offset], data, entry->size);
+      mark_dirty(image, entry->file_offset, entry->size);
+      data += entry->size;
+      available -= entry->size;
+    }
+  }
+  if (!valid) {
+    free(journal);
+    return "The undo journal is damaged";
+  }
 
-  // Jump to the real function to run the trigger
-  memory_offset = jmp(target, memory_offset, 0x47CE60);
+  // Everything after the original end of the file was added by the patches
+  resize_image(image, header->original_size);
+  bool restored = hash64(image->data, image->size, 0) == header->manifest.exe_hash;
+  printf("Restored %u ranges from the journal\n", header->entry_count);
+  memcpy(manifest, &header->manifest, sizeof(CacheKey));
+  free(journal);
+  if (!restored) {
+    return "The restored file does not match the original";
+  }
+  return NULL;
+}
 
-  // Install it by replacing the call destination (we'll jump to the real one)
-  call(target, 0x476E80, memory_offset_trigger_code);
+// Drops the parts of the dirty ranges which still hold the bytes of the previous file
+static void prune_dirty(Image* image, const uint8_t* previous, size_t previous_size) {
+  FileRange* dirty = image->dirty;
+  size_t dirty_count = image->dirty_count;
+  image->dirty = NULL;
+  image->dirty_count = 0;
+  image->dirty_capacity = 0;
+
+  size_t written_size = 0;
+  for(size_t i = 0; i < dirty_count; i++) {
+    size_t offset = dirty[i].offset;
+    size_t end = dirty[i].offset + dirty[i].size;
+    if (end > image->size) {
+      end = image->size;
+    }
+    while(offset < end) {
+
+      // Everything beyond the previous end of the file is new
+      if (offset >= previous_size) {
+        mark_dirty(image, offset, end - offset);
+        written_size += end - offset;
+        break;
+      }
+      if (image->data[offset] == previous[offset]) {
+        offset++;
+        continue;
+      }
+
+      // Short runs of equal bytes are written along, as each range costs a seek
+      size_t run_end = offset + 1;
+      size_t equal = 0;
+      while((run_end < end) && (equal < 16)) {
+        bool same = (run_end < previous_size) && (image->data[run_end] == previous[run_end]);
+        equal = same ? (equal + 1) : 0;
+        run_end++;
+      }
+      run_end -= equal;
+      mark_dirty(image, offset, run_end - offset);
+      written_size += run_end - offset;
+      offset = run_end;
+    }
+  }
+  printf("%zu bytes differ from the previous file in %zu ranges\n", written_size, image->dirty_count);
 
-  return memory_offset;
+  free(dirty);
+  return;
 }
 
-static void patch(Target target, uint32_t memory_offset) {
-#if 0
-  // This is a debug feature to dump the original font textures
-
-  dumpTextureTable(target, 0x4BF91C, 3, 0, 64, 128, "font0");
-  dumpTextureTable(target, 0x4BF7E4, 3, 0, 64, 128, "font1");
-  dumpTextureTable(target, 0x4BF84C, 3, 0, 64, 128, "font2");
-  dumpTextureTable(target, 0x4BF8B4, 3, 0, 64, 128, "font3");
-  dumpTextureTable(target, 0x4BF984, 3, 0, 64, 128, "font4");
 #endif
 
+// Options which are the same for every exe
+typedef struct {
+  Settings settings;
+  const TexturePack* pack;
 
-// Start the actual patching
+  // Signatures are used to find the sites in unknown versions of the game
+  const char* signatures_path;
+  const char* learn_path;
 
-#if 1
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF91C, 0x42D745, 0x42D753, 512, 1024, "font0");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF7E4, 0x42D786, 0x42D794, 512, 1024, "font1");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF84C, 0x42D7C7, 0x42D7D5, 512, 1024, "font2");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF8B4, 0x42D808, 0x42D816, 512, 1024, "font3");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF984, 0x42D849, 0x42D857, 512, 1024, "font4");
-#endif
+  // Deltas record the changes to the exe, so they can be applied without the patcher
+  const char* emit_delta_path;
 
-#if 1
-  uint8_t upgrade_levels[7]  = {    5,    5,    5,    5,    5,    5,    5 };
-  uint8_t upgrade_healths[7] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  // Writes the result to a new file instead of changing the exe
+  const char* output_path;
 
-  memory_offset = patch_network_upgrades(target, memory_offset, upgrade_levels, upgrade_healths);
-#endif
+  // Restores the original exe instead of patching it
+  bool unpatch;
 
-#if 1
-  memory_offset = patch_network_collisions(target, memory_offset);
-#endif
+  // Only reports which patch would write this address, if it's not 0
+  uint32_t who_owns;
 
-#if 0
-  uint32_t samplerate = 22050 * 2;
-  uint8_t bits_per_sample = 16;
-  bool stereo = true;
+  // Directory which keeps the results of previous runs
+  const char* cache_path;
+  bool cache_stats;
 
-  memory_offset = patch_audio_stream_quality(target, memory_offset, samplerate, bits_per_sample, stereo);
+#ifndef LOADER
+  // Output engine, NULL if the exes are written directly
+  Uring* uring;
 #endif
+} Options;
 
-#if 0
-  memory_offset = patch_sprite_loader_to_load_tga(target, memory_offset);
+typedef struct {
+  const char* path;
+  const char* version;
+  const char* error;
+  bool cached;
+  double milliseconds;
+
+  // Holds the error, if it had to be formatted
+  char message[256];
+} PatchResult;
+
+// Gives up on the game, without changing anything
+static bool abort_game(Target target, uint8_t* original, PatchResult* result, const char* error) {
+#ifdef LOADER
+  TerminateProcess(target.process_information.hProcess, 1);
+#else
+  discard_image(target.image);
 #endif
+  free(original);
+  result->error = error;
+  return false;
+}
 
-#if 0
-  memory_offset = patch_trigger_display(target, memory_offset);
-#endif
+#ifndef LOADER
 
-  // Dump out the network GUID
+// Builds the address translation from the section table.
+// Everything it points to has to be inside the file, so later accesses can't miss it.
+static bool map_sections(Target target, uint32_t image_base, uint32_t section_header, uint16_t section_count, uint32_t size_of_headers, char* error, size_t error_size) {
+  Image* image = target.image;
+  if (((uint64_t)size_of_headers > image->size) ||
+      (((uint64_t)section_header + section_count * 40) > ((uint64_t)image_base + size_of_headers))) {
+    snprintf(error, error_size, "The section table is not inside the headers of the file");
+    return false;
+  }
 
-  printf("Network GUID is: ");
-  for(int i = 0; i < 16; i++) {
-    printf("%02X", read8(target, 0x4AF9B0 + i));
+  // The arenas get sections too
+  if ((1 + section_count + ARENA_COUNT) > (sizeof(image->sections) / sizeof(image->sections[0]))) {
+    snprintf(error, error_size, "The exe has too many sections (%u)", section_count);
+    return false;
   }
-  printf("\n"); 
-}
 
-// Allocate more space, say... 4MB?
-// (we use the .rsrc section, which is last in memory)
-uint32_t patch_size = 4 * 1024 * 1024;
+  clear_sections(image);
+  map_section(image, image_base, 0x00000000, size_of_headers);
+  for(int i = 0; i < section_count; i++) {
+    uint32_t old_section_header = section_header + i * 40;
+    uint32_t virtual_size = read32(target, old_section_header + 8);
+    uint32_t virtual_address = read32(target, old_section_header + 12);
+    uint32_t size_of_raw_data = read32(target, old_section_header + 16);
+    uint32_t pointer_to_raw_data = read32(target, old_section_header + 20);
+
+    // Only the part which is backed by the file can be patched
+    uint32_t size = size_of_raw_data;
+    if ((virtual_size != 0) && (virtual_size < size)) {
+      size = virtual_size;
+    }
+    if ((size != 0) && (((uint64_t)pointer_to_raw_data + size) > image->size)) {
+      snprintf(error, error_size, "Section %d (0x%X bytes at 0x%X) is not inside the file of 0x%zX bytes",
+               i, size, pointer_to_raw_data, image->size);
+      return false;
+    }
+    map_section(image, image_base + virtual_address, pointer_to_raw_data, size);
+  }
+  return true;
+}
 
-#ifndef DLL
+#endif
 
-int main(int argc, char* argv[]) {
+// Patches one exe, or the game process when this is the loader.
+// Failures are reported in the result, so other exes are not affected.
+static bool patch_game(const char* path, const Options* options, PatchResult* result) {
 
   Target target;
 
+  Plan plan;
+  init_plan(&plan);
+  target.plan = &plan;
+
+  Allocator allocator;
+  target.allocator = &allocator;
+
+  result->path = path;
+  result->version = NULL;
+  result->error = NULL;
+  result->cached = false;
+  result->message[0] = '\0';
+
+  trace_stage("load");
+
   //FIXME: Retrieve this somehow
   uint32_t image_base = 0x400000;
 
+  // Keep the original around to compute the delta against
+  uint8_t* original = NULL;
+#ifndef LOADER
+  size_t original_size = 0;
+#endif
+
 #ifdef LOADER
 
   STARTUPINFO startup_info;
@@ -828,124 +5278,353 @@ int main(int argc, char* argv[]) {
   BOOL status = CreateProcess("swep1rcr.exe", cmd_line, NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &startup_info, &target.process_information);
 
   printf("Status: %d\n", status);
-
-  //FIXME: Error handling
+  if (!status) {
+    result->error = "Unable to start the game";
+    return false;
+  }
 
 #else
 
-  target.f = fopen(argv[1], "rb+");
-  assert(target.f != NULL);
+  Image image;
+  target.image = &image;
+  if (!load_image(target.image, path)) {
+    result->error = "Unable to open file";
+    return false;
+  }
+
+  // Runs which only look at the exe neither use nor fill the cache
+  bool use_cache = (options->cache_path != NULL) && !options->unpatch && (options->who_owns == 0) && (options->learn_path == NULL);
+
+  original_size = target.image->size;
+  if ((options->emit_delta_path != NULL) || use_cache) {
+    original = malloc(original_size);
+    assert(original != NULL);
+    memcpy(original, target.image->data, original_size);
+  }
+
+  // Nothing has to be done if the same exe has been patched the same way before
+  CacheKey cache_key;
+  if (use_cache) {
+    make_cache_key(&cache_key, target.image, &options->settings, options->pack, options->signatures_path);
+    bool hit = load_cached_result(options->cache_path, &cache_key, target.image);
+    update_cache_stats(options->cache_path, hit, options->cache_stats);
+    if (hit) {
+      result->version = "cached";
+      result->cached = true;
+      trace_stage("write");
+      if (!finish_image(target.image, options->emit_delta_path, options->output_path, original, original_size, options->uring, &result->error)) {
+        return false;
+      }
+      return true;
+    }
+  }
+
+  // Until the headers have been parsed, we can only access the start of the file
+  if (target.image->size < 0x200) {
+    return abort_game(target, original, result, "Not an exe");
+  }
+  map_section(target.image, image_base, 0x00000000, 0x200);
 
 #endif
 
+  trace_stage("pe_parse");
+
   //FIXME: Locate this properly
   uint32_t coff_header = image_base + 212;
 
   // Read timestamp of binary to see which base version this is
   uint32_t timestamp = read32(target, coff_header + 4);
 
-  //FIXME: Now set the correct pointers for this binary
-  switch(timestamp) {
-  case 0x3C60692C:
-    break;
-  default:
-    printf("Unsupported version of the game, timestamp 0x%08X\n", timestamp);
-    return 1;
-  }
-
   uint32_t optional_header = coff_header + 20;
-  assert(image_base == read32(target, optional_header + 28));
-
-#ifdef LOADER
-
-  uint32_t memory_offset = (uintptr_t)VirtualAllocEx(target.process_information.hProcess, NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-  printf("Allocated memory at 0x%08X\n", memory_offset);
+  if ((read32(target, coff_header - 4) != *(uint32_t*)"PE\0\0") || (image_base != read32(target, optional_header + 28))) {
+    return abort_game(target, original, result, "Not an exe of the game");
+  }
 
-#else
+#ifndef LOADER
 
   // Search for existing section
   uint32_t size_of_optional_header = read16(target, coff_header + 16);
   uint32_t section_header = optional_header + size_of_optional_header;
   uint16_t section_count = read16(target, coff_header + 2);
+  uint32_t size_of_headers = read32(target, optional_header + 60);
+
+  if (!map_sections(target, image_base, section_header, section_count, size_of_headers, result->message, sizeof(result->message))) {
+    return abort_game(target, original, result, result->message);
+  }
+
+  bool repatched = false;
+
 #if 1
+  bool patched = false;
+  uint32_t journal_pointer = 0;
+  uint32_t journal_size = 0;
   for(int i = 0; i < section_count; i++) {
     uint32_t old_section_header = section_header + i * 40;
     uint32_t n1 = read32(target, old_section_header + 0);
     uint32_t n2 = read32(target, old_section_header + 4);
-    if ((n1 == *(uint32_t*)"hack") && (n2 == 0x00000000)) {
-      fprintf(stderr, "This file had already been patched!\n"
-                      "This tool is unable to upgrade an existing patch.\n"
-                      "Please find an unmodified file.\n"
-                      "Aborting.\n");
+    // Empty arenas have no section, but every patched exe has at least the journal
+    if (n1 == *(uint32_t*)"hack") {
+      patched = true;
+    }
+    if ((n1 == *(uint32_t*)"hack") && (n2 == *(uint32_t*)"undo")) {
+      journal_size = read32(target, old_section_header + 16);
+      journal_pointer = read32(target, old_section_header + 20);
+    }
+  }
 
-      //FIXME: Undo patches, and allow to continue
+  if (options->unpatch && !patched) {
+    return abort_game(target, original, result, "This file is not patched");
+  }
 
-      return 1;
+  // A previous run is undone in memory, so only the differences have to be written in the end
+  if (patched) {
+    if (journal_size == 0) {
+      return abort_game(target, original, result, "This file was patched without an undo journal! "
+                                                  "Please find an unmodified file.");
     }
+    if (original == NULL) {
+      original = malloc(original_size);
+      assert(original != NULL);
+      memcpy(original, target.image->data, original_size);
+    }
+    trace_stage("restore");
+    CacheKey manifest;
+    const char* error = unpatch_image(target.image, journal_pointer, journal_size, &manifest);
+    if (error != NULL) {
+      return abort_game(target, original, result, error);
+    }
+    if (options->unpatch) {
+      result->version = "restored";
+      trace_stage("write");
+      return finish_image(target.image, options->emit_delta_path, options->output_path, original, original_size, options->uring, &result->error);
+    }
+
+    // The manifest of the previous run tells us if anything would change
+    CacheKey requested;
+    make_cache_key(&requested, target.image, &options->settings, options->pack, options->signatures_path);
+    if (!memcmp(&manifest, &requested, sizeof(CacheKey)) && (options->who_owns == 0)) {
+      printf("Already patched with these settings\n");
+      resize_image(target.image, original_size);
+      memcpy(target.image->data, original, original_size);
+      target.image->dirty_count = 0;
+      result->version = "unchanged";
+      trace_stage("write");
+      return finish_image(target.image, options->emit_delta_path, options->output_path, original, original_size, options->uring, &result->error);
+    }
+    printf("Updating a previous patch:%s%s%s%s\n", (manifest.patch_version != requested.patch_version) ? " patcher" : "",
+                                                    (manifest.signatures_hash != requested.signatures_hash) ? " signatures" : "",
+                                                    memcmp(&manifest.settings, &requested.settings, sizeof(Settings)) ? " settings" : "",
+                                                    (manifest.textures_checksum != requested.textures_checksum) ? " textures" : "");
+    repatched = true;
+
+    section_count = read16(target, coff_header + 2);
+    if (!map_sections(target, image_base, section_header, section_count, size_of_headers, result->message, sizeof(result->message))) {
+      return abort_game(target, original, result, result->message);
+    }
+    trace_stage("pe_parse");
   }
 #endif
 
-  // Get rough offset where we'll place our stuff
-  fseek(target.f, 0, SEEK_END);
-  uint32_t file_offset = ftell(target.f);
+#endif
+
+  // Now set the correct pointers for this binary
+  uint64_t fingerprint = fingerprint_image(target, image_base);
+  const Version* version = find_version(timestamp, fingerprint);
+#ifndef LOADER
+  Addresses scanned_addresses;
+#endif
+  if (version != NULL) {
+    printf("Detected version '%s', fingerprint %016llX\n", version->name, (unsigned long long)fingerprint);
+    target.addresses = &version->addresses;
+    result->version = version->name;
+  } else {
+    print_unknown_version(timestamp, fingerprint);
+    if (options->signatures_path == NULL) {
+      return abort_game(target, original, result, "Unsupported version of the game");
+    }
+#ifndef LOADER
+    if (!find_addresses(target.image, options->signatures_path, fingerprint, &scanned_addresses, result->message, sizeof(result->message))) {
+      return abort_game(target, original, result, result->message);
+    }
+    target.addresses = &scanned_addresses;
+    result->version = "scanned";
+#endif
+  }
+
+  // Reading the exe so far can already fail if it's broken
+  if (plan.failed) {
+    snprintf(result->message, sizeof(result->message), "%s", plan.error);
+    return abort_game(target, original, result, result->message);
+  }
+
+#ifdef LOADER
+
+  // Only reserve the memory, it will be committed once we know what's used
+  uint32_t memory_offset = (uintptr_t)VirtualAllocEx(target.process_information.hProcess, NULL, patch_size, MEM_RESERVE, PAGE_NOACCESS);
+  printf("Reserved memory at 0x%08X\n", memory_offset);
+  init_allocator(target.allocator, memory_offset, 0x1000, NULL);
+
+  patch(target, &options->settings, options->pack);
+  commit_arenas(target);
 
-  // Align offset to safe bound
-  fseek(target.f, file_offset, SEEK_SET);
-  file_offset = (file_offset + 0xFFF) & ~0xFFF;
+#else
 
-  // Append section data
-  while(ftell(target.f) < (file_offset + patch_size)) {
-    uint8_t dummy = 0x00;
-    fwrite(&dummy, 1, 1, target.f);
+  // Learning only reads the exe, it's not patched
+  if (options->learn_path != NULL) {
+    uint32_t size_of_image = read32(target, optional_header + 56);
+    if (!learn_signatures(target.image, image_base, size_of_image, target.addresses, options->learn_path)) {
+      return abort_game(target, original, result, "Unable to write the signatures");
+    }
+    printf("Wrote signatures to '%s'\n", options->learn_path);
+    discard_image(target.image);
+    free(original);
+    return true;
   }
 
+  uint32_t section_alignment = read32(target, optional_header + 32);
+  uint32_t file_alignment = read32(target, optional_header + 36);
+
+  // Place our stuff after the end of the file
+  uint32_t file_offset = align_up(target.image->size, file_alignment);
+
   // Select a unused memory region (after SizeOfImage) and align it
   uint32_t memory_offset = read32(target, optional_header + 56);
-  memory_offset = (memory_offset + 0xFFF) & ~0xFFF;
+  memory_offset = align_up(memory_offset, section_alignment);
 
-  // Create data for new section
-  uint32_t characteristics = 0;
-  characteristics |= 0x20; // Code
-  characteristics |= 0x40; // Initialized Data
-  characteristics |= 0x20000000; // Executable
-  characteristics |= 0x40000000; // Readable
-  characteristics |= 0x80000000; // Writeable
+  // Add image base
+  memory_offset += image_base;
 
-  // Append a new section
-  uint32_t size_of_headers = read32(target, optional_header + 60);
+  // The sections have to be contiguous, but the address of each arena has to be known before the patches run.
+  // So the patches are planned twice: first only to measure the arenas, each with the whole patch budget,
+  // then for real with each arena sized to what it needs.
+  trace_stage("measure");
+  plan.measuring = true;
+  uint32_t capacities[ARENA_COUNT];
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    capacities[i] = patch_size;
+  }
+  uint32_t added_section_count = 0;
+  for(int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      if (plan.failed) {
+        break;
+      }
+      for(int i = 0; i < ARENA_COUNT; i++) {
+        capacities[i] = align_up(allocator.arenas[i].size, section_alignment);
+      }
+      free_plan(&plan);
+      init_plan(&plan);
+    }
+    init_allocator(target.allocator, memory_offset, section_alignment, capacities);
+
+    patch(target, &options->settings, options->pack);
+
+    // Every arena with contents gets a section header, the journal is added below
+    added_section_count = 0;
+    for(int i = 0; i < ARENA_COUNT; i++) {
+      Arena* arena = &allocator.arenas[i];
+      if ((arena->size != 0) || (i == ARENA_JOURNAL)) {
+        added_section_count++;
+      }
+    }
+
+    // Keep the original bytes of the code and data which is changed, and of the headers that will be
+    FileRange header_ranges[] = {
+      { section_header + section_count * 40 - image_base, added_section_count * 40 },
+      { coff_header + 2 - image_base, 2 },
+      { optional_header + 4 - image_base, 8 },
+      { optional_header + 56 - image_base, 4 }
+    };
+    write_journal(target, &options->settings, options->pack, options->signatures_path, header_ranges, sizeof(header_ranges) / sizeof(header_ranges[0]));
+  }
+
+  // Append a section for each arena, sized to what the patches actually emitted
+  begin_patch(target, "pe_header");
   uint32_t new_section_header = section_header + section_count * 40;
-  assert((new_section_header + 40) <= (image_base + size_of_headers));
-  write32(target, new_section_header + 0, *(uint32_t*)"hack");
-  write32(target, new_section_header + 4, 0x00000000);
-  write32(target, new_section_header + 8, patch_size);
-  write32(target, new_section_header + 12, memory_offset);
-  write32(target, new_section_header + 16, patch_size);
-  write32(target, new_section_header + 20, file_offset);
-  write32(target, new_section_header + 24, 0x00000000);
-  write32(target, new_section_header + 28, 0x00000000);
-  write32(target, new_section_header + 32, 0x00000000);
-  write32(target, new_section_header + 36, characteristics);
+  uint32_t raw_offset = file_offset;
+  uint16_t new_section_count = 0;
+  uint32_t size_of_code = 0;
+  uint32_t size_of_initialized_data = 0;
+  for(int i = 0; i < ARENA_COUNT; i++) {
+    Arena* arena = &allocator.arenas[i];
+
+    // Each arena was sized to its contents, so the sections are contiguous without padding them
+    uint32_t virtual_size = arena->size;
+    if (virtual_size == 0) {
+      continue;
+    }
+    uint32_t raw_size = align_up(arena->size, file_alignment);
+
+    uint8_t name[8];
+    memset(name, 0x00, sizeof(name));
+    memcpy(name, arena->name, strlen(arena->name));
+
+    if ((new_section_header + 40) > (image_base + size_of_headers)) {
+      plan_error(&plan, "There is no room for another section header");
+      break;
+    }
+    write_data(target, new_section_header + 0, name, sizeof(name));
+    write32(target, new_section_header + 8, virtual_size);
+    write32(target, new_section_header + 12, arena->base - image_base);
+    write32(target, new_section_header + 16, raw_size);
+    write32(target, new_section_header + 20, (raw_size != 0) ? raw_offset : 0x00000000);
+    write32(target, new_section_header + 24, 0x00000000);
+    write32(target, new_section_header + 28, 0x00000000);
+    write32(target, new_section_header + 32, 0x00000000);
+    write32(target, new_section_header + 36, arena->characteristics);
+
+    if (arena->characteristics & 0x20) {
+      size_of_code += raw_size;
+    } else {
+      size_of_initialized_data += raw_size;
+    }
+
+    // Make the new section accessible
+    map_section(target.image, arena->base, raw_offset, raw_size);
+
+    new_section_header += 40;
+    new_section_count++;
+    raw_offset += raw_size;
+  }
 
   // Increment number of sections
-  patch16_add(target, coff_header + 2, 1);
+  patch16_add(target, coff_header + 2, new_section_count);
 
   // size of image
-  write32(target, optional_header + 56, memory_offset + patch_size);
+  write32(target, optional_header + 56, align_up(allocator_end(&allocator) - image_base, section_alignment));
 
   // size of code
-  patch32_add(target, optional_header + 4, patch_size);
+  patch32_add(target, optional_header + 4, size_of_code);
 
   // size of intialized data
-  patch32_add(target, optional_header + 8, patch_size);
-
-
-
-  // Add image base
-  memory_offset += image_base;
+  patch32_add(target, optional_header + 8, size_of_initialized_data);
+
+  // Extend the file to hold the new sections
+  resize_image(target.image, raw_offset);
+
+  // Queries only look at the plan, the exe is not patched
+  if ((options->who_owns != 0) && !plan.failed) {
+    const char* owner = find_owner(&plan, options->who_owns);
+    if (owner != NULL) {
+      printf("Address 0x%08X is written by patch '%s'\n", options->who_owns, owner);
+    } else {
+      printf("Address 0x%08X is not written by any patch\n", options->who_owns);
+    }
+    free_plan(&plan);
+    discard_image(target.image);
+    free(original);
+    return true;
+  }
 
 #endif
 
-  patch(target, memory_offset);
+  trace_stage("apply");
+  bool applied = apply_plan(target);
+  snprintf(result->message, sizeof(result->message), "%s", plan.error);
+  free_plan(&plan);
+  if (!applied) {
+    return abort_game(target, original, result, result->message);
+  }
 
 #ifdef LOADER
 
@@ -955,11 +5634,358 @@ int main(int argc, char* argv[]) {
 
 #else
 
-  fclose(target.f);
+  trace_stage("write");
+  if (repatched) {
+    prune_dirty(target.image, original, original_size);
+  }
+  if (use_cache) {
+    save_cached_result(options->cache_path, &cache_key, original, original_size, target.image->data, target.image->size);
+  }
+  if (!finish_image(target.image, options->emit_delta_path, options->output_path, original, original_size, options->uring, &result->error)) {
+    return false;
+  }
 
 #endif
 
-  return 0;
+  return true;
+}
+
+#ifndef LOADER
+
+// Exes which are patched in a batch
+typedef struct {
+  char** paths;
+  size_t count;
+  size_t capacity;
+} FileList;
+
+static void add_file(FileList* files, const char* path) {
+  if (files->count == files->capacity) {
+    files->capacity = files->capacity ? files->capacity * 2 : 64;
+    files->paths = realloc(files->paths, files->capacity * sizeof(char*));
+    assert(files->paths != NULL);
+  }
+  files->paths[files->count] = strdup(path);
+  assert(files->paths[files->count] != NULL);
+  files->count++;
+  return;
+}
+
+// Finds every copy of the game in a directory tree
+static void add_directory(FileList* files, const char* path) {
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while((entry = readdir(dir)) != NULL) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    char child[1024];
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    struct stat st;
+    if (stat(child, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      add_directory(files, child);
+    } else if (!strcasecmp(entry->d_name, "swep1rcr.exe")) {
+      add_file(files, child);
+    }
+  }
+  closedir(dir);
+  return;
+}
+
+// A batch is either a directory tree, or a text file with one path per line
+static bool add_batch(FileList* files, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    add_directory(files, path);
+    return true;
+  }
+
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  char line[1024];
+  while(fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if ((line[0] != '\0') && (line[0] != '#')) {
+      add_file(files, line);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Patching the same file twice at the same time would break it
+static void remove_duplicate_files(FileList* files) {
+  if (files->count == 0) {
+    return;
+  }
+  qsort(files->paths, files->count, sizeof(char*), compare_paths);
+  size_t count = 1;
+  for(size_t i = 1; i < files->count; i++) {
+    if (!strcmp(files->paths[i], files->paths[count - 1])) {
+      free(files->paths[i]);
+    } else {
+      files->paths[count++] = files->paths[i];
+    }
+  }
+  files->count = count;
+  return;
+}
+
+static void free_files(FileList* files) {
+  for(size_t i = 0; i < files->count; i++) {
+    free(files->paths[i]);
+  }
+  free(files->paths);
+  return;
+}
+
+// Exes are handed out to the workers one at a time, so slow ones don't hold up the rest
+typedef struct {
+  const Options* options;
+  const FileList* files;
+  PatchResult* results;
+  size_t next;
+  pthread_mutex_t mutex;
+} Fleet;
+
+static void* fleet_worker(void* user) {
+  Fleet* fleet = user;
+  while(true) {
+    pthread_mutex_lock(&fleet->mutex);
+    size_t i = fleet->next++;
+    pthread_mutex_unlock(&fleet->mutex);
+    if (i >= fleet->files->count) {
+      break;
+    }
+
+    PatchResult* result = &fleet->results[i];
+    double start = wall_milliseconds();
+    patch_game(fleet->files->paths[i], fleet->options, result);
+    result->milliseconds = wall_milliseconds() - start;
+  }
+  return NULL;
+}
+
+static bool patch_fleet(const FileList* files, const Options* options) {
+  Fleet fleet;
+  fleet.options = options;
+  fleet.files = files;
+  fleet.results = calloc(files->count, sizeof(PatchResult));
+  assert(fleet.results != NULL);
+  fleet.next = 0;
+  pthread_mutex_init(&fleet.mutex, NULL);
+
+  unsigned int worker_count = (thread_count != 0) ? thread_count : default_thread_count();
+  if (worker_count > files->count) {
+    worker_count = files->count;
+  }
+
+  // The messages of all exes would be mixed up, so only the table is shown
+  fflush(stdout);
+  int saved_stdout = dup(fileno(stdout));
+#ifdef _WIN32
+  FILE* null_file = freopen("NUL", "w", stdout);
+#else
+  FILE* null_file = freopen("/dev/null", "w", stdout);
+#endif
+  assert(null_file != NULL);
+
+  // The calling thread is also a worker
+  double start = wall_milliseconds();
+  pthread_t threads[64];
+  unsigned int started = 0;
+  for(unsigned int i = 1; (i < worker_count) && (started < (sizeof(threads) / sizeof(threads[0]))); i++) {
+    if (pthread_create(&threads[started], NULL, fleet_worker, &fleet) == 0) {
+      started++;
+    }
+  }
+  fleet_worker(&fleet);
+  for(unsigned int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (options->uring != NULL) {
+    drain_uring(options->uring);
+  }
+  double milliseconds = wall_milliseconds() - start;
+
+  fflush(stdout);
+  dup2(saved_stdout, fileno(stdout));
+  close(saved_stdout);
+
+  size_t patched_count = 0;
+  size_t cached_count = 0;
+  printf("%-8s %-10s %10s  %s\n", "Status", "Version", "Time", "File");
+  for(size_t i = 0; i < files->count; i++) {
+    PatchResult* result = &fleet.results[i];
+    if (result->error == NULL) {
+      patched_count++;
+      cached_count += result->cached;
+      printf("%-8s %-10s %7.1f ms  %s\n", result->cached ? "cached" : "patched", result->version, result->milliseconds, result->path);
+    } else {
+      printf("%-8s %-10s %7.1f ms  %s: %s\n", "FAILED", result->version ? result->version : "-", result->milliseconds, result->path, result->error);
+    }
+  }
+  printf("Patched %zu of %zu files (%zu from cache) with %u threads in %.1f ms\n", patched_count, files->count, cached_count, started + 1, milliseconds);
+
+  pthread_mutex_destroy(&fleet.mutex);
+  free(fleet.results);
+  return patched_count == files->count;
+}
+
+#endif
+
+int main(int argc, char* argv[]) {
+
+  Options options;
+  memset(&options, 0x00, sizeof(options));
+  default_settings(&options.settings);
+
+#ifndef LOADER
+
+  // Parse options, the remaining arguments are the paths of the exes
+  const char* apply_delta_path = NULL;
+  FileList files;
+  memset(&files, 0x00, sizeof(files));
+  bool use_uring = false;
+  bool valid = true;
+  for(int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--threads=", 10)) {
+      thread_count = atoi(&argv[i][10]);
+    } else if (!strncmp(argv[i], "--signatures=", 13)) {
+      options.signatures_path = &argv[i][13];
+    } else if (!strncmp(argv[i], "--learn-signatures=", 19)) {
+      options.learn_path = &argv[i][19];
+    } else if (!strncmp(argv[i], "--emit-delta=", 13)) {
+      options.emit_delta_path = &argv[i][13];
+    } else if (!strncmp(argv[i], "--who-owns=", 11)) {
+      options.who_owns = strtoul(&argv[i][11], NULL, 16);
+    } else if (!strcmp(argv[i], "--trace=json")) {
+      trace.enabled = true;
+    } else if (!strcmp(argv[i], "--unpatch")) {
+      options.unpatch = true;
+    } else if (!strncmp(argv[i], "--output=", 9)) {
+      options.output_path = &argv[i][9];
+    } else if (!strncmp(argv[i], "--apply-delta=", 14)) {
+      apply_delta_path = &argv[i][14];
+    } else if (!strncmp(argv[i], "--cache=", 8)) {
+      options.cache_path = &argv[i][8];
+    } else if (!strcmp(argv[i], "--cache-stats")) {
+      options.cache_stats = true;
+    } else if (!strcmp(argv[i], "--io-uring")) {
+      use_uring = true;
+    } else if (!strncmp(argv[i], "--batch=", 8)) {
+      if (!add_batch(&files, &argv[i][8])) {
+        fprintf(stderr, "Unable to read '%s'\n", &argv[i][8]);
+        valid = false;
+      }
+    } else {
+      add_file(&files, argv[i]);
+    }
+  }
+  remove_duplicate_files(&files);
+
+  // These only make sense for a single exe
+  bool batch = files.count > 1;
+  if (batch && ((options.learn_path != NULL) || (options.emit_delta_path != NULL) || (options.output_path != NULL) || (options.who_owns != 0) || trace.enabled || (apply_delta_path != NULL))) {
+    valid = false;
+  }
+  if (!valid || (files.count == 0)) {
+    fprintf(stderr, "Usage: %s [--threads=<count>] [--signatures=<path>] [--learn-signatures=<path>] [--emit-delta=<path>] [--apply-delta=<path>] [--output=<path>] [--unpatch] [--who-owns=<address>] [--trace=json] [--cache=<directory>] [--cache-stats] [--io-uring] [--batch=<list-or-directory>] <path-to-swep1rcr.exe>...\n", argv[0]);
+    free_files(&files);
+    return 1;
+  }
+
+  // Applying a delta doesn't need to know anything about the game
+  if (apply_delta_path != NULL) {
+    bool applied = apply_delta(files.paths[0], apply_delta_path, options.output_path);
+    free_files(&files);
+    return applied ? 0 : 1;
+  }
+
+#endif
+
+  // The textures are loaded once, even if many exes are patched
+  trace_stage("open_textures");
+  TexturePack pack;
+  if (options.settings.fonts) {
+    if (!open_texture_pack(&pack, "textures/fonts.pack")) {
+      return 1;
+    }
+    options.pack = &pack;
+  }
+
+  bool success;
+
+#ifndef LOADER
+
+  // Without io_uring, the exes are written one after another
+  Uring uring;
+  if (use_uring) {
+    if (init_uring(&uring)) {
+      options.uring = &uring;
+    } else {
+      printf("io_uring is not available, writing files directly\n");
+    }
+  }
+
+#endif
+
+#ifdef LOADER
+
+  PatchResult result;
+  success = patch_game(NULL, &options, &result);
+  if (!success) {
+    fprintf(stderr, "%s\n", result.error);
+  }
+
+#else
+
+  if (batch) {
+    if (options.pack != NULL) {
+      verify_texture_pack(&pack);
+    }
+    success = patch_fleet(&files, &options);
+  } else {
+    PatchResult result;
+    success = patch_game(files.paths[0], &options, &result);
+    if (options.uring != NULL) {
+      drain_uring(options.uring);
+    }
+    if (trace.enabled) {
+      write_trace(stderr, result.path, result.version, result.error);
+    }
+    if (result.error != NULL) {
+      fprintf(stderr, "%s\nAborting.\n", result.error);
+      success = false;
+    }
+  }
+  if (options.uring != NULL) {
+    close_uring(options.uring);
+  }
+  free_files(&files);
+
+#endif
+
+  if (options.pack != NULL) {
+    close_texture_pack(&pack);
+  }
+
+  return success ? 0 : 1;
 }
 
 #else
@@ -977,10 +6003,44 @@ HRESULT WINAPI DirectInputCreateA(uint32_t a, uint32_t b, uint32_t c, uint32_t d
   static HRESULT(WINAPI *o_DirectInputCreateA)(uint32_t, uint32_t, uint32_t, uint32_t) = NULL;
   if (o_DirectInputCreateA == NULL) {
 
+    Plan plan;
+    init_plan(&plan);
+
+    Allocator allocator;
+
     Target target;
-    uint32_t memory_offset = (uintptr_t)VirtualAlloc(NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-   
-    patch(target, memory_offset);
+    target.plan = &plan;
+    target.allocator = &allocator;
+
+    //FIXME: Retrieve this somehow
+    uint32_t image_base = 0x400000;
+    uint32_t timestamp = read32(target, image_base + 212 + 4);
+    const Version* version = find_version(timestamp, fingerprint_image(target, image_base));
+    // The game keeps using the mapped pack, so it's never closed
+    static TexturePack pack;
+    if (version == NULL) {
+
+      // The game still runs, just without patches
+      MessageBoxA(NULL, "Unsupported version of the game", "swe1r-patcher", 0);
+    } else if (!open_texture_pack(&pack, "textures/fonts.pack")) {
+      MessageBoxA(NULL, "Unable to open the textures", "swe1r-patcher", 0);
+    } else {
+      target.addresses = &version->addresses;
+
+      // Only reserve the memory, it will be committed once we know what's used
+      uint32_t memory_offset = (uintptr_t)VirtualAlloc(NULL, patch_size, MEM_RESERVE, PAGE_NOACCESS);
+      init_allocator(target.allocator, memory_offset, 0x1000, NULL);
+
+      Settings settings;
+      default_settings(&settings);
+      patch(target, &settings, &pack);
+
+      commit_arenas(target);
+      if (!apply_plan(target)) {
+        MessageBoxA(NULL, plan.error, "swe1r-patcher", 0);
+      }
+    }
+    free_plan(&plan);
 
     HMODULE dll = LoadLibrary("c:/windows/system32/dinput.dll");
     o_DirectInputCreateA = (void*)GetProcAddress(dll, "DirectInputCreateA");
@@ -0,0 +1,42 @@
+# Patches copies of an exe with plain writes and through io_uring, the results must be identical
+#
+# Usage: cmake -DPATCHER=<swe1r-patcher> -DEXE=<swep1rcr.exe> -DDIRECTORY=<scratch directory> -P test-io-uring.cmake
+# The patcher has to run in the build directory, so it finds textures/fonts.pack.
+# Point DIRECTORY at a tmpfs or a throttled device to test those.
+
+set(work ${DIRECTORY}/swe1r-io-uring-test)
+file(REMOVE_RECURSE ${work})
+file(MAKE_DIRECTORY ${work}/plain ${work}/uring/a ${work}/uring/b)
+file(COPY ${EXE} DESTINATION ${work}/plain)
+file(COPY ${EXE} DESTINATION ${work}/uring/a)
+file(COPY ${EXE} DESTINATION ${work}/uring/b)
+get_filename_component(name ${EXE} NAME)
+
+execute_process(COMMAND ${PATCHER} ${work}/plain/${name}
+                RESULT_VARIABLE result OUTPUT_QUIET)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Patching with plain writes failed")
+endif()
+
+# Two exes, so more than one chain is in flight
+execute_process(COMMAND ${PATCHER} --io-uring ${work}/uring/a/${name} ${work}/uring/b/${name}
+                RESULT_VARIABLE result OUTPUT_VARIABLE output)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Patching through io_uring failed:\n${output}")
+endif()
+
+foreach(copy a b)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${work}/plain/${name} ${work}/uring/${copy}/${name}
+                  RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "io_uring output of copy ${copy} differs from the plain output")
+  endif()
+endforeach()
+
+# No temporary files may be left behind
+file(GLOB leftovers ${work}/uring/*/*.tmp)
+if(leftovers)
+  message(FATAL_ERROR "Temporary files were left behind: ${leftovers}")
+endif()
+
+file(REMOVE_RECURSE ${work})
@@ -0,0 +1,108 @@
+# Learns signatures from an exe, then scans for them in copies the version table doesn't know
+#
+# Usage: cmake -DPATCHER=<swe1r-patcher> -DEXE=<swep1rcr.exe> -DDIRECTORY=<scratch directory> -P test-signatures.cmake
+# The patcher has to run in the build directory, so it finds textures/fonts.pack.
+#
+# One copy only has another timestamp, so every site must be found where it was learned.
+# The other copy also has its code moved 16 bytes up, like a build with a few more bytes in front,
+# so sites in the code must be found 16 bytes later and all others where they were learned.
+
+set(shift 16)
+set(work ${DIRECTORY}/swe1r-signatures-test)
+file(REMOVE_RECURSE ${work})
+file(MAKE_DIRECTORY ${work}/same ${work}/shifted)
+
+# Reads a little-endian number of `size` bytes at `offset` of the exe
+function(read_number variable offset size)
+  math(EXPR offset "${offset}")
+  file(READ ${EXE} hex OFFSET ${offset} LIMIT ${size} HEX)
+  set(value 0)
+  foreach(i RANGE ${size})
+    if (i LESS size)
+      math(EXPR position "(${size} - 1 - ${i}) * 2")
+      string(SUBSTRING ${hex} ${position} 2 byte)
+      math(EXPR value "(${value} << 8) | 0x${byte}")
+    endif()
+  endforeach()
+  set(${variable} ${value} PARENT_SCOPE)
+endfunction()
+
+read_number(pe_header 0x3C 4)
+math(EXPR timestamp_offset "${pe_header} + 8")
+read_number(optional_header_size "${pe_header} + 20" 2)
+math(EXPR section_header "${pe_header} + 24 + ${optional_header_size}")
+read_number(code_size "${section_header} + 16" 4)
+read_number(code_offset "${section_header} + 20" 4)
+read_number(image_base "${pe_header} + 24 + 28" 4)
+read_number(code_address "${section_header} + 12" 4)
+read_number(code_virtual_size "${section_header} + 8" 4)
+math(EXPR code_begin "${image_base} + ${code_address}")
+math(EXPR code_end "${code_begin} + ${code_virtual_size}")
+
+# Learn from the original
+file(COPY ${EXE} DESTINATION ${work})
+get_filename_component(name ${EXE} NAME)
+execute_process(COMMAND ${PATCHER} --learn-signatures=${work}/signatures.txt ${work}/${name}
+                RESULT_VARIABLE result OUTPUT_VARIABLE output)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Learning the signatures failed:\n${output}")
+endif()
+
+# The new timestamp are the first 4 bytes of the exe, "MZ" and some padding, so no version matches.
+# The shifted code is preceded by a copy of the first 16 bytes and loses as many at its end.
+math(EXPR after_timestamp "${timestamp_offset} + 4")
+math(EXPR before_code "${code_offset} - ${after_timestamp}")
+math(EXPR code_kept "${code_size} - ${shift}")
+math(EXPR after_code "${code_offset} + ${code_size}")
+set(splice "head -c ${timestamp_offset} \"$0\"; head -c 4 \"$0\"; tail -c +$((${after_timestamp} + 1)) \"$0\" | head -c ${before_code}")
+execute_process(COMMAND sh -c "{ ${splice}; tail -c +$((${code_offset} + 1)) \"$0\"; } > \"$1\"" ${EXE} ${work}/same/${name}
+                RESULT_VARIABLE result)
+execute_process(COMMAND sh -c "{ ${splice}; head -c ${shift} \"$0\"; tail -c +$((${code_offset} + 1)) \"$0\" | head -c ${code_kept}; tail -c +$((${after_code} + 1)) \"$0\"; } > \"$1\"" ${EXE} ${work}/shifted/${name}
+                RESULT_VARIABLE result2)
+if(NOT result EQUAL 0 OR NOT result2 EQUAL 0)
+  message(FATAL_ERROR "Unable to write the copies of the exe")
+endif()
+
+# Each copy is scanned with its own cache next to its own signatures
+foreach(copy same shifted)
+  file(COPY ${work}/signatures.txt DESTINATION ${work}/${copy})
+  execute_process(COMMAND ${PATCHER} --signatures=${work}/${copy}/signatures.txt ${work}/${copy}/${name}
+                  RESULT_VARIABLE result OUTPUT_VARIABLE output)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Patching the ${copy} copy with the learned signatures failed:\n${output}")
+  endif()
+  string(REGEX MATCHALL "Found '[a-z0-9_]+' at 0x[0-9A-F]+" ${copy}_found "${output}")
+  if(NOT ${copy}_found)
+    message(FATAL_ERROR "No sites were scanned for in the ${copy} copy:\n${output}")
+  endif()
+endforeach()
+
+list(LENGTH same_found count)
+list(LENGTH shifted_found shifted_count)
+if(NOT count EQUAL shifted_count)
+  message(FATAL_ERROR "Found ${count} sites in the same copy, but ${shifted_count} in the shifted copy")
+endif()
+foreach(found ${same_found})
+  string(REGEX REPLACE "Found '([a-z0-9_]+)' at 0x([0-9A-F]+)" "\\1;\\2" parts "${found}")
+  list(GET parts 0 site)
+  list(GET parts 1 address)
+  math(EXPR address "0x${address}")
+  if(address GREATER_EQUAL code_begin AND address LESS code_end)
+    math(EXPR address "${address} + ${shift}" OUTPUT_FORMAT HEXADECIMAL)
+  else()
+    math(EXPR address "${address}" OUTPUT_FORMAT HEXADECIMAL)
+  endif()
+  string(TOUPPER ${address} address)
+  string(REPLACE "0X" "" address ${address})
+  string(LENGTH ${address} length)
+  while(length LESS 8)
+    set(address "0${address}")
+    string(LENGTH ${address} length)
+  endwhile()
+  list(FIND shifted_found "Found '${site}' at 0x${address}" index)
+  if(index EQUAL -1)
+    message(FATAL_ERROR "Site '${site}' wasn't found at 0x${address} in the shifted copy:\n${shifted_found}")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE ${work})
@@ -0,0 +1,64 @@
+# Generates the table of known versions for main.c from versions.txt
+#
+# Usage: cmake -DINPUT=<versions.txt> -DOUTPUT=<versions.h> -P versions.cmake
+
+file(STRINGS ${INPUT} lines)
+
+# Each version is written once all of its lines have been read
+set(out "// Generated from versions.txt, do not edit\n\nstatic const Version versions[] = {\n")
+set(name "")
+macro(finish_version)
+  if(NOT name STREQUAL "")
+    list(LENGTH fingerprints fingerprint_count)
+    if(fingerprint_count GREATER 8)
+      message(FATAL_ERROR "Version ${name} in ${INPUT} has more than 8 fingerprints")
+    endif()
+    set(out "${out}  {\n    .name = \"${name}\",\n    .timestamp = ${version_timestamp},\n")
+    set(out "${out}    .fingerprints = {")
+    foreach(fingerprint IN LISTS fingerprints)
+      set(out "${out} ${fingerprint}ULL,")
+    endforeach()
+    if(fingerprint_count EQUAL 0)
+      set(out "${out} 0,")
+    endif()
+    set(out "${out} },\n    .fingerprint_count = ${fingerprint_count},\n")
+    set(out "${out}    .addresses = {{\n${addresses}    }}\n  },\n")
+  endif()
+endmacro()
+
+foreach(line IN LISTS lines)
+  string(STRIP "${line}" line)
+  if(NOT line STREQUAL "" AND NOT line MATCHES "^#")
+    string(REGEX REPLACE "[ \t]+" ";" fields "${line}")
+    list(LENGTH fields field_count)
+    if(NOT field_count EQUAL 2)
+      message(FATAL_ERROR "Invalid line in ${INPUT}: ${line}")
+    endif()
+    list(GET fields 0 key)
+    list(GET fields 1 value)
+
+    if(key STREQUAL "version")
+      finish_version()
+      set(name "${value}")
+      set(version_timestamp 0)
+      set(fingerprints "")
+      set(addresses "")
+    elseif(name STREQUAL "")
+      message(FATAL_ERROR "Line outside of a version in ${INPUT}: ${line}")
+    elseif(key STREQUAL "timestamp")
+      set(version_timestamp ${value})
+    elseif(key STREQUAL "fingerprint")
+      if(NOT value MATCHES "^0x[0-9A-Fa-f]+$")
+        message(FATAL_ERROR "Invalid fingerprint in ${INPUT}: ${line}")
+      endif()
+      list(APPEND fingerprints ${value})
+    else()
+      string(TOUPPER "${key}" site)
+      set(addresses "${addresses}      [SITE_${site}] = ${value},\n")
+    endif()
+  endif()
+endforeach()
+finish_version()
+set(out "${out}};\n")
+
+file(WRITE ${OUTPUT} "${out}")